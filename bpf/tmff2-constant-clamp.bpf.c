@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Limit the constant force a game can ask for, for games that clip the
+ * wheel's motor all the time. Needs hid-tmff2 loaded with hid_bpf_output=1,
+ * otherwise commands don't go through hid_hw_output_report and the hook is
+ * never called.
+ *
+ * Commands are in the T300RS protocol after the report id, see
+ * docs/FFBEFFECTS.md. New constant (0x6a) and magnitude modify (0x0a)
+ * commands carry the level in bytes 4 and 5, [-16385, 16381] on the wheel.
+ * With pack_commands set only the first command of a report is looked at.
+ */
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+#define TMFF2_REPORT_ID		0x60
+#define TMFF2_LEVEL_MAX		8192
+
+HID_BPF_CONFIG(
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb66e),	/* T300RS PS3 */
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb66f),	/* T300RS PS3 advanced */
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb66d),	/* T300RS PS4 */
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb696),	/* T248 */
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb669),	/* TX */
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb692),	/* TS-XW */
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb689)	/* TS-PC */
+);
+
+SEC(HID_BPF_HW_OUTPUT_REPORT)
+int BPF_PROG(tmff2_constant_clamp, struct hid_bpf_ctx *hctx, __u64 source)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0, 6);
+	__s16 level;
+
+	if (!data || data[0] != TMFF2_REPORT_ID)
+		return 0;
+
+	if (data[3] != 0x6a && data[3] != 0x0a)
+		return 0;
+
+	level = (__s16)(data[4] | data[5] << 8);
+	if (level > TMFF2_LEVEL_MAX)
+		level = TMFF2_LEVEL_MAX;
+	else if (level < -TMFF2_LEVEL_MAX)
+		level = -TMFF2_LEVEL_MAX;
+
+	data[4] = level & 0xff;
+	data[5] = (level >> 8) & 0xff;
+
+	/* carry on sending the rewritten report */
+	return 0;
+}
+
+HID_BPF_OPS(tmff2_constant_clamp) = {
+	.hid_hw_output_report = (void *)tmff2_constant_clamp,
+};
+
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+	ctx->retval = 0;
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
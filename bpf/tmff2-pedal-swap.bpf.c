@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Swap the gas and clutch axes of a T300RS in PS3 mode, for pedal sets that
+ * are wired the other way around. The report is rewritten before hid-input,
+ * hidraw and hid-tmff2's own input decoding get to see it.
+ *
+ * Report 7 holds the wheel in bytes 1-2, then brake, gas and clutch as 16
+ * bit values in bytes 3-4, 5-6 and 7-8.
+ */
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+#define TMFF2_INPUT_REPORT_ID	0x07
+
+HID_BPF_CONFIG(
+	HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, 0x044f, 0xb66e)	/* T300RS PS3 */
+);
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(tmff2_pedal_swap, struct hid_bpf_ctx *hctx)
+{
+	__u8 *data = hid_bpf_get_data(hctx, 0, 9);
+	__u8 gas[2];
+
+	if (!data || data[0] != TMFF2_INPUT_REPORT_ID)
+		return 0;
+
+	gas[0] = data[5];
+	gas[1] = data[6];
+	data[5] = data[7];
+	data[6] = data[8];
+	data[7] = gas[0];
+	data[8] = gas[1];
+
+	return 0;
+}
+
+HID_BPF_OPS(tmff2_pedal_swap) = {
+	.hid_device_event = (void *)tmff2_pedal_swap,
+};
+
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+	ctx->retval = 0;
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,454 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <linux/module.h>
+#include <linux/hid.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include "hid-tmff2.h"
+#include "hid-tmff2-uapi.h"
+
+/* /dev/tmff2-<n>, a character device per wheel through which userspace can
+ * send pre-encoded commands in the wheel's own protocol, one per write. The
+ * backend checks each command, and the work handler sends queued commands in
+ * between the driver's own, paced like everything else. Tools that used to
+ * write to hidraw directly raced the driver for the output endpoint.
+ *
+ * The TMFF2_IOC_BATCH ioctl updates and plays several evdev effects in one
+ * go instead, and with a slot reserved for it the first page can be mapped
+ * to stream torque without any syscalls, see hid-tmff2-uapi.h. */
+#define TMFF2_RAW_MAX		64
+#define TMFF2_RAW_QUEUE		64
+#define TMFF2_RAW_PER_TICK	8
+
+struct tmff2_raw_command {
+	u8 len;
+	u8 slot;
+	u8 buf[TMFF2_RAW_MAX];
+};
+
+/* lock protects the fifo and dead, batch_lock keeps dead from changing while
+ * a batch is applied. Open files hold a reference, so users that are still
+ * around after the wheel is removed get -ENODEV instead of touching freed
+ * memory. */
+struct tmff2_cdev {
+	struct miscdevice misc;
+	char name[24];
+	struct kref ref;
+	spinlock_t lock;
+	struct mutex batch_lock;
+	bool dead;
+	wait_queue_head_t wait;
+	struct kfifo fifo;
+	struct tmff2_device_entry *tmff2;
+
+	/* torque stream, NULL without a reserved slot. The work handler reads
+	 * the mailbox for as long as any mapping of it is left. */
+	struct tmff2_stream_mailbox *mailbox;
+	atomic_t mapped;
+
+	/* where raw commands go relative to the driver's effects, see
+	 * TMFF2_CLIENT_PRIORITIES */
+	u32 priority;
+
+	unsigned long submitted;
+	unsigned long rejected;
+	unsigned long sent;
+	unsigned long failed;
+	unsigned long conflicts;
+	unsigned long batches;
+	unsigned long batch_entries;
+};
+
+static void tmff2_cdev_release_ref(struct kref *ref)
+{
+	struct tmff2_cdev *cdev = container_of(ref, struct tmff2_cdev, ref);
+
+	free_page((unsigned long)cdev->mailbox);
+	kfifo_free(&cdev->fifo);
+	mutex_destroy(&cdev->batch_lock);
+	kfree(cdev);
+}
+
+static bool tmff2_cdev_writable(struct tmff2_cdev *cdev)
+{
+	bool writable;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cdev->lock, flags);
+	writable = cdev->dead ||
+		kfifo_avail(&cdev->fifo) >= sizeof(struct tmff2_raw_command);
+	spin_unlock_irqrestore(&cdev->lock, flags);
+
+	return writable;
+}
+
+static int tmff2_cdev_open(struct inode *inode, struct file *file)
+{
+	struct tmff2_cdev *cdev = container_of(file->private_data,
+			struct tmff2_cdev, misc);
+
+	kref_get(&cdev->ref);
+	file->private_data = cdev;
+	return 0;
+}
+
+static int tmff2_cdev_release(struct inode *inode, struct file *file)
+{
+	struct tmff2_cdev *cdev = file->private_data;
+
+	kref_put(&cdev->ref, tmff2_cdev_release_ref);
+	return 0;
+}
+
+static ssize_t tmff2_cdev_write(struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct tmff2_cdev *cdev = file->private_data;
+	struct tmff2_device_entry *tmff2;
+	struct tmff2_raw_command command = {0};
+	unsigned long flags;
+	int ret;
+
+	if (!count || count > TMFF2_RAW_MAX)
+		return -EINVAL;
+
+	if (copy_from_user(command.buf, ubuf, count))
+		return -EFAULT;
+
+	command.len = count;
+
+	for (;;) {
+		spin_lock_irqsave(&cdev->lock, flags);
+		if (cdev->dead) {
+			ret = -ENODEV;
+			goto out;
+		}
+
+		if (kfifo_avail(&cdev->fifo) >= sizeof(command))
+			break;
+
+		spin_unlock_irqrestore(&cdev->lock, flags);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(cdev->wait,
+					tmff2_cdev_writable(cdev)))
+			return -ERESTARTSYS;
+	}
+
+	tmff2 = cdev->tmff2;
+	ret = tmff2->check_raw(tmff2->data, command.buf, command.len);
+	if (ret < 0 || ret >= tmff2->max_effects) {
+		cdev->rejected++;
+		ret = -EINVAL;
+		goto out;
+	}
+
+	command.slot = ret;
+	kfifo_in(&cdev->fifo, &command, sizeof(command));
+	cdev->submitted++;
+	tmff2_queue_raw(tmff2);
+	ret = count;
+out:
+	spin_unlock_irqrestore(&cdev->lock, flags);
+	return ret;
+}
+
+static long tmff2_cdev_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct tmff2_cdev *cdev = file->private_data;
+	struct tmff2_batch_entry *entries;
+	struct tmff2_batch batch;
+	long ret;
+
+	if (cmd != TMFF2_IOC_BATCH)
+		return -ENOTTY;
+
+	if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > TMFF2_BATCH_MAX || batch.reserved)
+		return -EINVAL;
+
+	entries = memdup_user(u64_to_user_ptr(batch.entries),
+			array_size(batch.count, sizeof(*entries)));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	mutex_lock(&cdev->batch_lock);
+	if (cdev->dead) {
+		ret = -ENODEV;
+	} else {
+		ret = tmff2_batch(cdev->tmff2, entries, batch.count);
+		if (!ret) {
+			cdev->batches++;
+			cdev->batch_entries += batch.count;
+		}
+	}
+	mutex_unlock(&cdev->batch_lock);
+
+	kfree(entries);
+	return ret;
+}
+
+static void tmff2_cdev_queue_stream(struct tmff2_cdev *cdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cdev->lock, flags);
+	if (!cdev->dead)
+		tmff2_queue_stream(cdev->tmff2);
+	spin_unlock_irqrestore(&cdev->lock, flags);
+}
+
+static void tmff2_cdev_vm_open(struct vm_area_struct *vma)
+{
+	struct tmff2_cdev *cdev = vma->vm_private_data;
+
+	if (atomic_inc_return(&cdev->mapped) == 1)
+		tmff2_cdev_queue_stream(cdev);
+}
+
+static void tmff2_cdev_vm_close(struct vm_area_struct *vma)
+{
+	struct tmff2_cdev *cdev = vma->vm_private_data;
+
+	if (atomic_dec_and_test(&cdev->mapped))
+		tmff2_cdev_queue_stream(cdev);
+}
+
+static const struct vm_operations_struct tmff2_cdev_vm_ops = {
+	.open = tmff2_cdev_vm_open,
+	.close = tmff2_cdev_vm_close,
+};
+
+static int tmff2_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tmff2_cdev *cdev = file->private_data;
+	int ret;
+
+	if (!cdev->mailbox)
+		return -ENODEV;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE ||
+			!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(cdev->mailbox) >> PAGE_SHIFT,
+			vma->vm_end - vma->vm_start, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &tmff2_cdev_vm_ops;
+	vma->vm_private_data = cdev;
+	tmff2_cdev_vm_open(vma);
+	return 0;
+}
+
+static __poll_t tmff2_cdev_poll(struct file *file, poll_table *wait)
+{
+	struct tmff2_cdev *cdev = file->private_data;
+
+	poll_wait(file, &cdev->wait, wait);
+
+	if (READ_ONCE(cdev->dead))
+		return EPOLLERR | EPOLLHUP;
+
+	return tmff2_cdev_writable(cdev) ? EPOLLOUT | EPOLLWRNORM : 0;
+}
+
+static const struct file_operations tmff2_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = tmff2_cdev_open,
+	.release = tmff2_cdev_release,
+	.write = tmff2_cdev_write,
+	.poll = tmff2_cdev_poll,
+	.unlocked_ioctl = tmff2_cdev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = tmff2_cdev_mmap,
+	.llseek = noop_llseek,
+};
+
+int tmff2_cdev_init(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_cdev *cdev;
+	int ret;
+
+	/* only backends that know how to check commands get a device */
+	if (!tmff2->check_raw || !tmff2->send_raw)
+		return 0;
+
+	cdev = kzalloc(sizeof(*cdev), GFP_KERNEL);
+	if (!cdev)
+		return -ENOMEM;
+
+	ret = kfifo_alloc(&cdev->fifo,
+			TMFF2_RAW_QUEUE * sizeof(struct tmff2_raw_command),
+			GFP_KERNEL);
+	if (ret)
+		goto fifo_err;
+
+	if (tmff2->stream.slot >= 0) {
+		cdev->mailbox = (void *)get_zeroed_page(GFP_KERNEL);
+		if (!cdev->mailbox) {
+			ret = -ENOMEM;
+			goto mailbox_err;
+		}
+	}
+
+	kref_init(&cdev->ref);
+	spin_lock_init(&cdev->lock);
+	mutex_init(&cdev->batch_lock);
+	init_waitqueue_head(&cdev->wait);
+	cdev->tmff2 = tmff2;
+
+	snprintf(cdev->name, sizeof(cdev->name), "tmff2-%u", tmff2->hdev->id);
+	cdev->misc.minor = MISC_DYNAMIC_MINOR;
+	cdev->misc.name = cdev->name;
+	cdev->misc.fops = &tmff2_cdev_fops;
+	cdev->misc.parent = &tmff2->hdev->dev;
+	cdev->misc.mode = 0660;
+
+	if ((ret = misc_register(&cdev->misc)))
+		goto misc_err;
+
+	tmff2->cdev = cdev;
+	return 0;
+
+misc_err:
+	mutex_destroy(&cdev->batch_lock);
+	free_page((unsigned long)cdev->mailbox);
+mailbox_err:
+	kfifo_free(&cdev->fifo);
+fifo_err:
+	kfree(cdev);
+	return ret;
+}
+
+/* the work handler must not be running anymore */
+void tmff2_cdev_destroy(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_cdev *cdev = tmff2->cdev;
+	unsigned long flags;
+
+	if (!cdev)
+		return;
+
+	misc_deregister(&cdev->misc);
+
+	mutex_lock(&cdev->batch_lock);
+	spin_lock_irqsave(&cdev->lock, flags);
+	cdev->dead = true;
+	spin_unlock_irqrestore(&cdev->lock, flags);
+	mutex_unlock(&cdev->batch_lock);
+
+	wake_up_interruptible_all(&cdev->wait);
+	tmff2->cdev = NULL;
+	kref_put(&cdev->ref, tmff2_cdev_release_ref);
+}
+
+int tmff2_cdev_priority(struct tmff2_device_entry *tmff2)
+{
+	return min_t(u32, READ_ONCE(tmff2->cdev->priority),
+			TMFF2_CLIENT_PRIORITIES - 1);
+}
+
+/* called by the work handler, sends up to TMFF2_RAW_PER_TICK queued commands.
+ * Commands for a slot the driver has an effect in would clobber it, those are
+ * dropped. Slots commands were sent to are marked so that the driver stops
+ * them before it uses them itself. Returns true if commands are left for the
+ * next tick. */
+bool tmff2_cdev_dispatch(struct tmff2_device_entry *tmff2, bool *sent)
+{
+	struct tmff2_cdev *cdev = tmff2->cdev;
+	struct tmff2_raw_command command;
+	struct tmff2_effect_payload *payload;
+	unsigned long flags;
+	unsigned int n, i;
+	bool more;
+
+	for (i = 0; i < TMFF2_RAW_PER_TICK; ++i) {
+		spin_lock_irqsave(&cdev->lock, flags);
+		n = kfifo_out(&cdev->fifo, &command, sizeof(command));
+		spin_unlock_irqrestore(&cdev->lock, flags);
+
+		if (n != sizeof(command))
+			break;
+
+		payload = &tmff2->payloads[command.slot];
+		if ((payload->held & ~BIT(TMFF2_SLOT_RAW)) || payload->wanted) {
+			cdev->conflicts++;
+			continue;
+		}
+
+		/* the resync only happens once ff-core hands the slot out */
+		__set_bit(TMFF2_SLOT_RAW, &payload->held);
+		set_bit(FF_EFFECT_RESYNC, &tmff2->states[command.slot].flags);
+
+		if (tmff2->send_raw(tmff2->data, command.buf, command.len))
+			cdev->failed++;
+		else
+			cdev->sent++;
+
+		hid_hw_wait(tmff2->hdev);
+		*sent = true;
+	}
+
+	spin_lock_irqsave(&cdev->lock, flags);
+	more = !kfifo_is_empty(&cdev->fifo);
+	spin_unlock_irqrestore(&cdev->lock, flags);
+
+	wake_up_interruptible(&cdev->wait);
+	return more;
+}
+
+/* called by the work handler, whether the stream mailbox is mapped and the
+ * latest level stored in it */
+bool tmff2_cdev_stream(struct tmff2_device_entry *tmff2, s16 *level, u32 *seq)
+{
+	struct tmff2_cdev *cdev = tmff2->cdev;
+
+	if (!cdev || !cdev->mailbox || !atomic_read(&cdev->mapped))
+		return false;
+
+	*seq = smp_load_acquire(&cdev->mailbox->seq);
+	*level = READ_ONCE(cdev->mailbox->level);
+	return true;
+}
+
+void tmff2_cdev_stream_ack(struct tmff2_device_entry *tmff2, u32 seq)
+{
+	WRITE_ONCE(tmff2->cdev->mailbox->sent, seq);
+}
+
+void tmff2_cdev_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir)
+{
+	struct tmff2_cdev *cdev = tmff2->cdev;
+
+	if (!cdev)
+		return;
+
+	debugfs_create_u32("raw_priority", 0600, dir, &cdev->priority);
+	debugfs_create_ulong("raw_submitted", 0444, dir, &cdev->submitted);
+	debugfs_create_ulong("raw_rejected", 0444, dir, &cdev->rejected);
+	debugfs_create_ulong("raw_sent", 0444, dir, &cdev->sent);
+	debugfs_create_ulong("raw_failed", 0444, dir, &cdev->failed);
+	debugfs_create_ulong("raw_conflicts", 0444, dir, &cdev->conflicts);
+	debugfs_create_ulong("batches", 0444, dir, &cdev->batches);
+	debugfs_create_ulong("batch_entries", 0444, dir, &cdev->batch_entries);
+}
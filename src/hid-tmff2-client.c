@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <linux/module.h>
+#include <linux/hid.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include "hid-tmff2.h"
+
+/* ff-core doesn't tell us which file an effect was uploaded through, but the
+ * upload ioctl runs in the context of the uploading process, so effect slots
+ * are attributed to processes. Entry 0 collects whatever doesn't fit into the
+ * table. */
+#define TMFF2_MAX_CLIENTS	8
+#define TMFF2_MAX_CLIENT_RULES	8
+
+struct tmff2_client {
+	pid_t tgid;		/* 0 if unused */
+	char comm[TASK_COMM_LEN];
+	unsigned int slots;	/* effect slots owned */
+	int priority;
+	unsigned int rate;	/* packets per second, 0 for no limit */
+
+	/* owned by the work handler, token bucket in packets * HZ */
+	unsigned long tokens;
+	unsigned long refilled;	/* jiffies */
+
+	unsigned long uploads;
+	unsigned long plays;
+	unsigned long packets;
+	unsigned long deferred;
+};
+
+/* priority and rate for processes with a given name, applied when a process
+ * first uploads an effect and whenever the rules change */
+struct tmff2_client_rule {
+	char comm[TASK_COMM_LEN];
+	int priority;
+	unsigned int rate;
+};
+
+/* lock serialises uploads, which run under ff->mutex, against rule changes.
+ * The work handler reads owner, priority and rate without it. */
+struct tmff2_clients {
+	spinlock_t lock;
+	struct tmff2_client client[TMFF2_MAX_CLIENTS];
+	struct tmff2_client_rule rules[TMFF2_MAX_CLIENT_RULES];
+	unsigned int nr_rules;
+	u8 owner[];	/* client per effect slot */
+};
+
+int tmff2_client_init(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_clients *clients;
+
+	clients = kzalloc(struct_size(clients, owner, tmff2->max_effects),
+			GFP_KERNEL);
+	if (!clients)
+		return -ENOMEM;
+
+	spin_lock_init(&clients->lock);
+	strscpy(clients->client[0].comm, "(other)", TASK_COMM_LEN);
+	tmff2->clients = clients;
+	return 0;
+}
+
+void tmff2_client_destroy(struct tmff2_device_entry *tmff2)
+{
+	kfree(tmff2->clients);
+	tmff2->clients = NULL;
+}
+
+static void tmff2_client_apply_rules(struct tmff2_clients *clients,
+		struct tmff2_client *client)
+{
+	unsigned int i;
+
+	WRITE_ONCE(client->priority, 0);
+	WRITE_ONCE(client->rate, 0);
+
+	for (i = 0; i < clients->nr_rules; ++i) {
+		if (strcmp(clients->rules[i].comm, client->comm))
+			continue;
+
+		WRITE_ONCE(client->priority, clients->rules[i].priority);
+		WRITE_ONCE(client->rate, clients->rules[i].rate);
+		break;
+	}
+}
+
+/* entry of the current process, a new one if it doesn't have one yet. Entries
+ * that no longer own any slots are reused. */
+static int tmff2_client_find(struct tmff2_clients *clients)
+{
+	struct tmff2_client *client;
+	int i, unused = 0;
+
+	for (i = 1; i < TMFF2_MAX_CLIENTS; ++i) {
+		client = &clients->client[i];
+		if (client->tgid == current->tgid)
+			return i;
+
+		if (!unused && !client->slots)
+			unused = i;
+	}
+
+	if (!unused)
+		return 0;
+
+	client = &clients->client[unused];
+	memset(client, 0, sizeof(*client));
+	client->tgid = current->tgid;
+	get_task_comm(client->comm, current->group_leader);
+	client->tokens = HZ;
+	client->refilled = jiffies;
+	tmff2_client_apply_rules(clients, client);
+	return unused;
+}
+
+void tmff2_client_upload(struct tmff2_device_entry *tmff2, int id)
+{
+	struct tmff2_clients *clients = tmff2->clients;
+	struct tmff2_client *old;
+	unsigned long flags;
+	int i;
+
+	if (!clients)
+		return;
+
+	spin_lock_irqsave(&clients->lock, flags);
+	i = tmff2_client_find(clients);
+	if (clients->owner[id] != i) {
+		old = &clients->client[clients->owner[id]];
+		if (old->slots)
+			old->slots--;
+
+		clients->client[i].slots++;
+		WRITE_ONCE(clients->owner[id], i);
+	}
+
+	clients->client[i].uploads++;
+	spin_unlock_irqrestore(&clients->lock, flags);
+}
+
+/* the effect in slot id was erased, e.g. when its owner closed the device */
+void tmff2_client_erase(struct tmff2_device_entry *tmff2, int id)
+{
+	struct tmff2_clients *clients = tmff2->clients;
+	struct tmff2_client *old;
+	unsigned long flags;
+
+	if (!clients)
+		return;
+
+	spin_lock_irqsave(&clients->lock, flags);
+	old = &clients->client[clients->owner[id]];
+	if (old->slots)
+		old->slots--;
+
+	WRITE_ONCE(clients->owner[id], 0);
+	spin_unlock_irqrestore(&clients->lock, flags);
+}
+
+void tmff2_client_play(struct tmff2_device_entry *tmff2, int id)
+{
+	struct tmff2_clients *clients = tmff2->clients;
+
+	if (clients)
+		clients->client[clients->owner[id]].plays++;
+}
+
+int tmff2_client_priority(struct tmff2_device_entry *tmff2, int id)
+{
+	struct tmff2_clients *clients = tmff2->clients;
+
+	if (!clients)
+		return 0;
+
+	return READ_ONCE(clients->client[READ_ONCE(clients->owner[id])].priority);
+}
+
+/* whether the current process uploaded the effect in slot id */
+bool tmff2_client_owns(struct tmff2_device_entry *tmff2, int id)
+{
+	struct tmff2_clients *clients = tmff2->clients;
+	int i;
+
+	if (!clients)
+		return false;
+
+	i = READ_ONCE(clients->owner[id]);
+	return i && clients->client[i].tgid == current->tgid;
+}
+
+/* whether the requests in flags have to wait for the owner of the slot to
+ * get more budget. Stops always go through, so a throttled client can't leave
+ * an effect playing. */
+bool tmff2_client_throttled(struct tmff2_device_entry *tmff2, int id,
+		unsigned long flags)
+{
+	const unsigned long budgeted = BIT(FF_EFFECT_QUEUE_UPLOAD) |
+		BIT(FF_EFFECT_QUEUE_START) | BIT(FF_EFFECT_QUEUE_UPDATE);
+	struct tmff2_clients *clients = tmff2->clients;
+	struct tmff2_client *client;
+	unsigned long now = jiffies, elapsed, burst;
+	unsigned int rate;
+
+	if (!clients)
+		return false;
+
+	client = &clients->client[READ_ONCE(clients->owner[id])];
+	rate = READ_ONCE(client->rate);
+	if (!rate || !(flags & budgeted) || test_bit(FF_EFFECT_QUEUE_STOP, &flags))
+		return false;
+
+	/* allow bursts of up to 100 ms worth of packets */
+	elapsed = min(now - client->refilled, (unsigned long)HZ);
+	burst = max(rate / 10, 1U) * HZ;
+	client->tokens = min(client->tokens + elapsed * rate, burst);
+	client->refilled = now;
+
+	if (client->tokens >= HZ)
+		return false;
+
+	client->deferred++;
+	return true;
+}
+
+void tmff2_client_charge(struct tmff2_device_entry *tmff2, int id,
+		unsigned long actions)
+{
+	struct tmff2_clients *clients = tmff2->clients;
+	struct tmff2_client *client;
+	unsigned long cost;
+
+	if (!clients)
+		return;
+
+	client = &clients->client[READ_ONCE(clients->owner[id])];
+	cost = hweight_long(actions);
+	client->packets += cost;
+	client->tokens -= min(client->tokens, cost * HZ);
+}
+
+static int tmff2_clients_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_clients *clients = tmff2->clients;
+	struct tmff2_client *client;
+	unsigned int i;
+
+	seq_printf(m, "%-16s %8s %8s\n", "rule", "priority", "rate");
+	for (i = 0; i < clients->nr_rules; ++i)
+		seq_printf(m, "%-16s %8i %8u\n", clients->rules[i].comm,
+				clients->rules[i].priority,
+				clients->rules[i].rate);
+
+	seq_printf(m, "\n%7s %-16s %5s %8s %8s %8s %8s %8s %8s\n",
+			"pid", "comm", "slots", "priority", "rate", "uploads",
+			"plays", "packets", "deferred");
+
+	for (i = 0; i < TMFF2_MAX_CLIENTS; ++i) {
+		client = &clients->client[i];
+		if (i && !client->tgid)
+			continue;
+
+		seq_printf(m, "%7i %-16s %5u %8i %8u %8lu %8lu %8lu %8lu\n",
+				client->tgid, client->comm, client->slots,
+				client->priority, client->rate, client->uploads,
+				client->plays, client->packets,
+				client->deferred);
+	}
+
+	return 0;
+}
+
+/* rules are written as
+ *
+ *	comm priority rate
+ *
+ * with priority from 0 to TMFF2_CLIENT_PRIORITIES - 1, higher going first,
+ * and rate in packets per second, 0 for no limit. Writing a rule for a comm
+ * that already has one replaces it, "clear" removes all of them. */
+static int tmff2_clients_parse(char *buf, struct tmff2_client_rule *rule)
+{
+	char *token;
+	int ret, field = 0;
+
+	while ((token = strsep(&buf, " \t\n"))) {
+		if (!*token)
+			continue;
+
+		switch (field++) {
+			case 0:
+				strscpy(rule->comm, token, TASK_COMM_LEN);
+				break;
+			case 1:
+				if ((ret = kstrtoint(token, 0, &rule->priority)))
+					return ret;
+
+				if (rule->priority < 0 ||
+						rule->priority >= TMFF2_CLIENT_PRIORITIES)
+					return -ERANGE;
+				break;
+			case 2:
+				if ((ret = kstrtouint(token, 0, &rule->rate)))
+					return ret;
+				break;
+			default:
+				return -EINVAL;
+		}
+	}
+
+	return field == 3 ? 0 : -EINVAL;
+}
+
+static ssize_t tmff2_clients_write(struct file *file, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_clients *clients = tmff2->clients;
+	struct tmff2_client_rule rule = {0};
+	unsigned long flags;
+	char buf[64];
+	unsigned int i;
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+
+	buf[count] = '\0';
+
+	if (sysfs_streq(buf, "clear")) {
+		spin_lock_irqsave(&clients->lock, flags);
+		clients->nr_rules = 0;
+		goto apply;
+	}
+
+	if ((ret = tmff2_clients_parse(buf, &rule)))
+		return ret;
+
+	spin_lock_irqsave(&clients->lock, flags);
+	for (i = 0; i < clients->nr_rules; ++i)
+		if (!strcmp(clients->rules[i].comm, rule.comm))
+			break;
+
+	if (i == TMFF2_MAX_CLIENT_RULES) {
+		spin_unlock_irqrestore(&clients->lock, flags);
+		return -ENOSPC;
+	}
+
+	clients->rules[i] = rule;
+	if (i == clients->nr_rules)
+		clients->nr_rules++;
+
+apply:
+	for (i = 1; i < TMFF2_MAX_CLIENTS; ++i)
+		if (clients->client[i].tgid)
+			tmff2_client_apply_rules(clients, &clients->client[i]);
+
+	spin_unlock_irqrestore(&clients->lock, flags);
+	return count;
+}
+
+static int tmff2_clients_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tmff2_clients_show, inode->i_private);
+}
+
+static const struct file_operations tmff2_clients_fops = {
+	.owner = THIS_MODULE,
+	.open = tmff2_clients_open,
+	.read = seq_read,
+	.write = tmff2_clients_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void tmff2_client_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir)
+{
+	if (!tmff2->clients)
+		return;
+
+	debugfs_create_file("clients", 0600, dir, tmff2, &tmff2_clients_fops);
+}
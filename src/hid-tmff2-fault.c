@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <linux/module.h>
+#include <linux/hid.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fault-inject.h>
+#include "hid-tmff2.h"
+
+#ifdef CONFIG_FAULT_INJECTION
+/* output faults, configured through the fault injection framework in debugfs
+ * under tmff2/fail_send_{drop,error,delay}, see
+ * Documentation/fault-injection/fault-injection.rst for the knobs. A drop
+ * pretends the packet went out when it didn't, like a bad cable or hub would,
+ * an error fails the send and a delay stalls it for fail_send_delay_us. */
+static DECLARE_FAULT_ATTR(tmff2_fail_drop);
+static DECLARE_FAULT_ATTR(tmff2_fail_error);
+static DECLARE_FAULT_ATTR(tmff2_fail_delay);
+static u32 tmff2_fail_delay_us = 4000;
+
+enum tmff2_fault tmff2_inject_fault(struct hid_device *hdev)
+{
+	struct tmff2_device_entry *tmff2 = hid_get_drvdata(hdev);
+	enum tmff2_fault fault = TMFF2_FAULT_NONE;
+
+	if (should_fail(&tmff2_fail_delay, 1)) {
+		usleep_range(tmff2_fail_delay_us, tmff2_fail_delay_us + 100);
+		if (tmff2)
+			tmff2->recovery.delayed++;
+	}
+
+	if (should_fail(&tmff2_fail_error, 1))
+		fault = TMFF2_FAULT_ERROR;
+	else if (should_fail(&tmff2_fail_drop, 1))
+		fault = TMFF2_FAULT_DROP;
+
+	if (tmff2 && fault) {
+		tmff2->recovery.injected++;
+		tmff2->recovery.faulted = true;
+	}
+
+	return fault;
+}
+
+void tmff2_fault_init(struct dentry *root)
+{
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	fault_create_debugfs_attr("fail_send_drop", root, &tmff2_fail_drop);
+	fault_create_debugfs_attr("fail_send_error", root, &tmff2_fail_error);
+	fault_create_debugfs_attr("fail_send_delay", root, &tmff2_fail_delay);
+	debugfs_create_u32("fail_send_delay_us", 0600, root,
+			&tmff2_fail_delay_us);
+#endif
+}
+#endif
+
+/* recovery tracking, the work handler brackets what it sends for one effect
+ * slot or command with these. A target diverges when a send for it fails or
+ * a fault is injected into it, and counts as recovered once a later send for
+ * it goes through cleanly. since is the target's own timestamp, 0 while it
+ * is in sync. */
+void tmff2_fault_begin(struct tmff2_device_entry *tmff2)
+{
+	tmff2->recovery.faulted = false;
+}
+
+void tmff2_fault_end(struct tmff2_device_entry *tmff2, ktime_t *since,
+		int ret)
+{
+	struct tmff2_recovery *recovery = &tmff2->recovery;
+	s64 delta;
+
+	if (ret || recovery->faulted) {
+		if (!*since) {
+			*since = ktime_get();
+			recovery->diverged++;
+		}
+		return;
+	}
+
+	if (!*since)
+		return;
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), *since));
+	*since = 0;
+
+	recovery->recovered++;
+	recovery->total_ns += delta;
+	if (delta > recovery->max_ns)
+		recovery->max_ns = delta;
+}
+
+static int tmff2_recovery_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_recovery *recovery = &tmff2->recovery;
+	unsigned int i, out_of_sync = 0;
+
+	for (i = 0; i < tmff2->max_effects; ++i)
+		if (tmff2->payloads[i].diverged)
+			out_of_sync++;
+
+	for (i = 0; i < TMFF2_CMDS; ++i)
+		if (tmff2->commands[i].diverged)
+			out_of_sync++;
+
+	seq_printf(m, "injected: %lu\n", recovery->injected);
+	seq_printf(m, "delayed: %lu\n", recovery->delayed);
+	seq_printf(m, "diverged: %lu\n", recovery->diverged);
+	seq_printf(m, "recovered: %lu\n", recovery->recovered);
+	seq_printf(m, "out of sync: %u\n", out_of_sync);
+
+	if (recovery->recovered)
+		seq_printf(m, "recovery avg/max: %lld/%lld us\n",
+				div_s64(div_s64(recovery->total_ns,
+						recovery->recovered), NSEC_PER_USEC),
+				div_s64(recovery->max_ns, NSEC_PER_USEC));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_recovery);
+
+void tmff2_fault_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir)
+{
+	debugfs_create_file("recovery", 0444, dir, tmff2,
+			&tmff2_recovery_fops);
+}
@@ -0,0 +1,785 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <linux/module.h>
+#include <linux/hid.h>
+#include <linux/hidraw.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include "hid-tmff2.h"
+
+static bool fast_input = 0;
+module_param(fast_input, bool, 0444);
+MODULE_PARM_DESC(fast_input,
+		"Decode input reports directly instead of through hid-input");
+
+/* same mapping as hid-input uses */
+static const struct {
+	__s32 x;
+	__s32 y;
+} tmff2_hat_to_axis[] = {
+	{ 0, 0}, { 0, -1}, { 1, -1}, { 1, 0}, { 1, 1},
+	{ 0, 1}, {-1, 1}, {-1, 0}, {-1, -1}
+};
+
+/* calibrated axes, matched by usage. All the fixed descriptors use the same
+ * usages for these. */
+enum tmff2_axis {
+	TMFF2_AXIS_WHEEL,
+	TMFF2_AXIS_THROTTLE,
+	TMFF2_AXIS_BRAKE,
+	TMFF2_AXIS_CLUTCH,
+	TMFF2_AXES
+};
+
+static const struct {
+	const char *name;
+	__u32 hid;
+	bool centered;
+} tmff2_axes[TMFF2_AXES] = {
+	[TMFF2_AXIS_WHEEL]	= {"wheel", HID_GD_X, true},
+	[TMFF2_AXIS_THROTTLE]	= {"throttle", HID_GD_Z, false},
+	[TMFF2_AXIS_BRAKE]	= {"brake", HID_GD_RZ, false},
+	[TMFF2_AXIS_CLUTCH]	= {"clutch", HID_GD_Y, false},
+};
+
+/* calibration works in a normalised [0, TMFF2_CAL_ONE] space, the curve and
+ * deadzone are given in permille of that */
+#define TMFF2_CAL_ONE		65535
+#define TMFF2_CURVE_POINTS	16
+
+struct tmff2_axis_calibration {
+	bool active;
+	__s32 min;	/* raw values the axis actually reaches */
+	__s32 max;
+	__u16 deadzone;
+	unsigned int points;	/* 0 for a linear response */
+	__u16 curve_x[TMFF2_CURVE_POINTS];
+	__u16 curve_y[TMFF2_CURVE_POINTS];
+};
+
+/* replaced as a whole on every change, reports are handled in interrupt
+ * context and only ever see a complete set */
+struct tmff2_calibration {
+	struct rcu_head rcu;
+	struct tmff2_axis_calibration axes[TMFF2_AXES];
+};
+
+/* where each mapped usage lives in the report. The wheels use fixed report
+ * descriptors, so the layout is known once hid-input has mapped the usages
+ * and can be walked with a flat table instead of going through every field
+ * (and the vendor filler in the PS4 descriptor) on every report. */
+struct tmff2_input_usage {
+	unsigned int offset;	/* in bits, after the report ID */
+	unsigned int size;	/* in bits */
+	__s32 logical_minimum;
+	__s32 logical_maximum;
+	__u32 hid;
+	__u16 code;
+	__u8 type;
+	__u8 is_signed:1;
+	__u8 null_state:1;
+	__u8 is_hat:1;
+	__s8 hat_min;
+	__s8 hat_max;
+	__s8 hat_dir;
+};
+
+/* inter-report intervals, bucket i >= 1 holds [125 << (i - 1), 125 << i) us */
+#define TMFF2_INTERVAL_BUCKETS	10
+#define TMFF2_INTERVAL_BASE_US	125
+
+/* only touched from raw_event, which hid-core calls for one report at a
+ * time, debugfs readers may see slightly torn values */
+struct tmff2_input_stats {
+	ktime_t last;
+	u64 reports;
+	u64 total_us;
+	u32 min_us;
+	u32 max_us;
+	u32 last_us;
+	u32 jitter;	/* RFC 3550 style estimator, in 1/16 us */
+	u64 buckets[TMFF2_INTERVAL_BUCKETS];
+};
+
+struct tmff2_input {
+	struct input_dev *input;
+	bool direct;	/* decode here instead of in hid-input */
+	unsigned int report_id;
+	unsigned int length;	/* in bytes, without the report ID */
+
+	struct mutex calibration_lock;	/* serialises writers */
+	struct tmff2_calibration __rcu *calibration;
+	int axis_usage[TMFF2_AXES];	/* index into usages, or -1 */
+
+	struct tmff2_input_stats stats;
+
+	unsigned int count;
+	struct tmff2_input_usage usages[];
+};
+
+/* number of usages the decoder would have to handle for report, or negative
+ * if the report contains something it can't decode */
+static int tmff2_input_count(struct hid_report *report)
+{
+	struct hid_field *field;
+	struct hid_usage *usage;
+	int i, j, count = 0;
+
+	for (i = 0; i < report->maxfield; ++i) {
+		field = report->field[i];
+
+		for (j = 0; j < field->report_count && j < field->maxusage; ++j) {
+			usage = &field->usage[j];
+
+			/* not mapped by hid-input, e.g. filler */
+			if (!usage->type)
+				continue;
+
+			if (!(field->flags & HID_MAIN_ITEM_VARIABLE)
+					|| (field->flags & HID_MAIN_ITEM_RELATIVE))
+				return -EINVAL;
+
+			if (usage->type != EV_KEY && usage->type != EV_ABS)
+				return -EINVAL;
+
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void tmff2_input_fill(struct tmff2_input *decoder,
+		struct hid_report *report)
+{
+	struct tmff2_input_usage *u = decoder->usages;
+	struct hid_field *field;
+	struct hid_usage *usage;
+	unsigned int end;
+	int i, j, axis;
+
+	for (axis = 0; axis < TMFF2_AXES; ++axis)
+		decoder->axis_usage[axis] = -1;
+
+	for (i = 0; i < report->maxfield; ++i) {
+		field = report->field[i];
+
+		for (j = 0; j < field->report_count && j < field->maxusage; ++j) {
+			usage = &field->usage[j];
+			if (!usage->type)
+				continue;
+
+			u->offset = field->report_offset + j * field->report_size;
+			u->size = field->report_size;
+			u->logical_minimum = field->logical_minimum;
+			u->logical_maximum = field->logical_maximum;
+			u->is_signed = field->logical_minimum < 0;
+			u->null_state = !!(field->flags & HID_MAIN_ITEM_NULL_STATE);
+			u->hid = usage->hid;
+			u->type = usage->type;
+			u->code = usage->code;
+			u->hat_min = usage->hat_min;
+			u->hat_max = usage->hat_max;
+			u->hat_dir = usage->hat_dir;
+			u->is_hat = usage->hat_min < usage->hat_max
+				|| usage->hat_dir;
+
+			end = DIV_ROUND_UP(u->offset + u->size, 8);
+			if (end > decoder->length)
+				decoder->length = end;
+
+			for (axis = 0; axis < TMFF2_AXES; ++axis) {
+				if (u->type == EV_ABS && u->hid == tmff2_axes[axis].hid
+						&& decoder->axis_usage[axis] < 0)
+					decoder->axis_usage[axis] = u - decoder->usages;
+			}
+
+			u++;
+		}
+	}
+}
+
+/* build the layout table for the first input report hid-input mapped
+ * anything in, must be called after hid_hw_start. The table is used for
+ * calibration and, if enabled, for decoding the report directly. */
+int tmff2_input_init(struct tmff2_device_entry *tmff2)
+{
+	struct hid_device *hdev = tmff2->hdev;
+	struct hid_report_enum *report_enum = &hdev->report_enum[HID_INPUT_REPORT];
+	struct tmff2_input *decoder;
+	struct hid_report *report;
+	int count = 0;
+
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		if ((count = tmff2_input_count(report)))
+			break;
+	}
+
+	if (count <= 0 || !report->field[0]->hidinput) {
+		hid_info(hdev, "no report suitable for decoding directly\n");
+		return 0;
+	}
+
+	decoder = kzalloc(struct_size(decoder, usages, count), GFP_KERNEL);
+	if (!decoder)
+		return -ENOMEM;
+
+	decoder->input = report->field[0]->hidinput->input;
+	decoder->report_id = report->id;
+	decoder->count = count;
+	mutex_init(&decoder->calibration_lock);
+	tmff2_input_fill(decoder, report);
+
+	/* hiddev only gets reports through the generic path */
+	decoder->direct = fast_input;
+	if (fast_input && (hdev->claimed & HID_CLAIMED_HIDDEV)) {
+		hid_info(hdev, "hiddev in use, not decoding input directly\n");
+		decoder->direct = false;
+	}
+
+	/* reports may already be coming in */
+	smp_store_release(&tmff2->input, decoder);
+
+	hid_dbg(hdev, "report %u has %u usages, %s\n",
+			decoder->report_id, decoder->count,
+			decoder->direct ? "decoding directly" : "using hid-input");
+	return 0;
+}
+
+/* must be called after hid_hw_stop, once no more reports can arrive */
+void tmff2_input_destroy(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_input *decoder = tmff2->input;
+
+	if (!decoder)
+		return;
+
+	kfree(rcu_dereference_protected(decoder->calibration, 1));
+	kfree(decoder);
+	tmff2->input = NULL;
+}
+
+/* piecewise-linear interpolation of x through the curve, both in
+ * [0, TMFF2_CAL_ONE] */
+static __s32 tmff2_input_curve(const struct tmff2_axis_calibration *c, __s32 x)
+{
+	__s32 x0, x1, y0, y1;
+	int i;
+
+	for (i = 1; i < c->points - 1; ++i) {
+		if (x < c->curve_x[i] * TMFF2_CAL_ONE / 1000)
+			break;
+	}
+
+	x0 = c->curve_x[i - 1] * TMFF2_CAL_ONE / 1000;
+	x1 = c->curve_x[i] * TMFF2_CAL_ONE / 1000;
+	y0 = c->curve_y[i - 1] * TMFF2_CAL_ONE / 1000;
+	y1 = c->curve_y[i] * TMFF2_CAL_ONE / 1000;
+
+	if (x1 == x0)
+		return y1;
+
+	return y0 + div_s64((s64)(x - x0) * (y1 - y0), x1 - x0);
+}
+
+/* map a raw value through the axis calibration, the result is in the
+ * logical range of the field so userspace sees the same axis limits */
+static __s32 tmff2_input_calibrate(const struct tmff2_axis_calibration *c,
+		const struct tmff2_input_usage *u, bool centered, __s32 value)
+{
+	const __s32 half = TMFF2_CAL_ONE / 2;
+	__s32 x, d, dz;
+
+	value = clamp(value, c->min, c->max);
+	x = div_s64((s64)(value - c->min) * TMFF2_CAL_ONE, c->max - c->min);
+
+	if (centered) {
+		/* deadzone and curve are symmetric around the center */
+		d = abs(x - half);
+		dz = c->deadzone * half / 1000;
+		d = d <= dz ? 0 : div_s64((s64)(d - dz) * TMFF2_CAL_ONE, half - dz);
+		d = min(d, TMFF2_CAL_ONE);
+
+		if (c->points)
+			d = tmff2_input_curve(c, d);
+
+		d /= 2;
+		x = x < half ? half - d : half + d;
+	} else {
+		dz = c->deadzone * TMFF2_CAL_ONE / 1000;
+		x = x <= dz ? 0 :
+			div_s64((s64)(x - dz) * TMFF2_CAL_ONE, TMFF2_CAL_ONE - dz);
+
+		if (c->points)
+			x = tmff2_input_curve(c, x);
+	}
+
+	return u->logical_minimum + div_s64((s64)x *
+			(u->logical_maximum - u->logical_minimum), TMFF2_CAL_ONE);
+}
+
+/* counterpart of hid_field_extract */
+static void tmff2_input_implement(u8 *data, unsigned int offset,
+		unsigned int n, u32 value)
+{
+	unsigned int bit, bits;
+	u8 mask;
+
+	while (n) {
+		bit = offset % 8;
+		bits = min(8 - bit, n);
+		mask = GENMASK(bit + bits - 1, bit);
+
+		data[offset / 8] = (data[offset / 8] & ~mask)
+			| ((value << bit) & mask);
+
+		value >>= bits;
+		offset += bits;
+		n -= bits;
+	}
+}
+
+/* rewrite the calibrated axes in the report itself, so that hid-input,
+ * hidraw and the direct decoder all see the same values */
+static void tmff2_input_apply_calibration(struct tmff2_device_entry *tmff2,
+		struct tmff2_input *decoder, u8 *data)
+{
+	const struct tmff2_calibration *cal;
+	const struct tmff2_axis_calibration *c;
+	const struct tmff2_input_usage *u;
+	__s32 value;
+	int axis;
+
+	rcu_read_lock();
+
+	if (!(cal = rcu_dereference(decoder->calibration)))
+		goto out;
+
+	for (axis = 0; axis < TMFF2_AXES; ++axis) {
+		c = &cal->axes[axis];
+		if (!c->active || decoder->axis_usage[axis] < 0)
+			continue;
+
+		u = &decoder->usages[decoder->axis_usage[axis]];
+
+		value = hid_field_extract(tmff2->hdev, data, u->offset, u->size);
+		if (u->is_signed)
+			value = sign_extend32(value, u->size - 1);
+
+		value = tmff2_input_calibrate(c, u, tmff2_axes[axis].centered,
+				value);
+		tmff2_input_implement(data, u->offset, u->size, value);
+	}
+
+out:
+	rcu_read_unlock();
+}
+
+/* sysfs, one file per axis in a calibration directory. Written as
+ *
+ *	min max deadzone [x:y ...]
+ *
+ * with min and max in raw axis units, the deadzone and curve points in
+ * permille. The curve has to start at x=0 and end at x=1000, for the wheel it
+ * applies to both halves symmetrically. Writing "none" removes the
+ * calibration. */
+static int tmff2_input_parse_axis(struct device *dev, char *buf,
+		struct tmff2_axis_calibration *c)
+{
+	char *token, *y;
+	unsigned int x_val, y_val, dz;
+	int ret, field = 0;
+
+	memset(c, 0, sizeof(*c));
+
+	while ((token = strsep(&buf, " \t\n"))) {
+		if (!*token)
+			continue;
+
+		switch (field++) {
+			case 0:
+				if (!strcmp(token, "none"))
+					return 0;
+
+				if ((ret = kstrtoint(token, 0, &c->min)))
+					return ret;
+				break;
+			case 1:
+				if ((ret = kstrtoint(token, 0, &c->max)))
+					return ret;
+				break;
+			case 2:
+				if ((ret = kstrtouint(token, 0, &dz)))
+					return ret;
+
+				if (dz >= 1000)
+					return -ERANGE;
+
+				c->deadzone = dz;
+				break;
+			default:
+				if (c->points == TMFF2_CURVE_POINTS) {
+					dev_err(dev, "at most %i curve points\n",
+							TMFF2_CURVE_POINTS);
+					return -E2BIG;
+				}
+
+				if (!(y = strchr(token, ':')))
+					return -EINVAL;
+
+				*y++ = '\0';
+				if ((ret = kstrtouint(token, 0, &x_val))
+						|| (ret = kstrtouint(y, 0, &y_val)))
+					return ret;
+
+				if (x_val > 1000 || y_val > 1000)
+					return -ERANGE;
+
+				if (c->points && x_val <= c->curve_x[c->points - 1]) {
+					dev_err(dev, "curve points must be in increasing order\n");
+					return -EINVAL;
+				}
+
+				c->curve_x[c->points] = x_val;
+				c->curve_y[c->points] = y_val;
+				c->points++;
+				break;
+		}
+	}
+
+	if (field < 3 || c->min >= c->max) {
+		dev_err(dev, "expected 'min max deadzone [x:y ...]'\n");
+		return -EINVAL;
+	}
+
+	if (c->points && (c->points < 2 || c->curve_x[0] != 0
+				|| c->curve_x[c->points - 1] != 1000)) {
+		dev_err(dev, "curve has to run from x=0 to x=1000\n");
+		return -EINVAL;
+	}
+
+	c->active = true;
+	return 0;
+}
+
+static int tmff2_input_axis_from_attr(struct device_attribute *attr)
+{
+	int axis;
+
+	for (axis = 0; axis < TMFF2_AXES; ++axis) {
+		if (!strcmp(attr->attr.name, tmff2_axes[axis].name))
+			return axis;
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t tmff2_axis_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct tmff2_device_entry *tmff2 = hid_get_drvdata(to_hid_device(dev));
+	struct tmff2_calibration *cal, *old;
+	struct tmff2_axis_calibration c;
+	struct tmff2_input *decoder;
+	int axis, ret;
+	char *copy;
+
+	if (!tmff2 || !(decoder = tmff2->input))
+		return -ENODEV;
+
+	if ((axis = tmff2_input_axis_from_attr(attr)) < 0)
+		return axis;
+
+	if (decoder->axis_usage[axis] < 0)
+		return -ENODEV;
+
+	if (!(copy = kstrndup(buf, count, GFP_KERNEL)))
+		return -ENOMEM;
+
+	ret = tmff2_input_parse_axis(dev, copy, &c);
+	kfree(copy);
+	if (ret)
+		return ret;
+
+	mutex_lock(&decoder->calibration_lock);
+
+	old = rcu_dereference_protected(decoder->calibration,
+			lockdep_is_held(&decoder->calibration_lock));
+
+	if (old)
+		cal = kmemdup(old, sizeof(*cal), GFP_KERNEL);
+	else
+		cal = kzalloc(sizeof(*cal), GFP_KERNEL);
+
+	if (!cal) {
+		mutex_unlock(&decoder->calibration_lock);
+		return -ENOMEM;
+	}
+
+	cal->axes[axis] = c;
+	rcu_assign_pointer(decoder->calibration, cal);
+	mutex_unlock(&decoder->calibration_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return count;
+}
+
+static ssize_t tmff2_axis_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct tmff2_device_entry *tmff2 = hid_get_drvdata(to_hid_device(dev));
+	const struct tmff2_axis_calibration *c;
+	struct tmff2_calibration *cal;
+	struct tmff2_input *decoder;
+	int axis, i;
+	ssize_t len;
+
+	if (!tmff2 || !(decoder = tmff2->input))
+		return -ENODEV;
+
+	if ((axis = tmff2_input_axis_from_attr(attr)) < 0)
+		return axis;
+
+	mutex_lock(&decoder->calibration_lock);
+
+	cal = rcu_dereference_protected(decoder->calibration,
+			lockdep_is_held(&decoder->calibration_lock));
+
+	if (!cal || !cal->axes[axis].active) {
+		len = scnprintf(buf, PAGE_SIZE, "none\n");
+		goto out;
+	}
+
+	c = &cal->axes[axis];
+	len = scnprintf(buf, PAGE_SIZE, "%i %i %u", c->min, c->max, c->deadzone);
+	for (i = 0; i < c->points; ++i)
+		len += scnprintf(buf + len, PAGE_SIZE - len, " %u:%u",
+				c->curve_x[i], c->curve_y[i]);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+out:
+	mutex_unlock(&decoder->calibration_lock);
+	return len;
+}
+
+static struct device_attribute tmff2_axis_attrs[TMFF2_AXES] = {
+	[TMFF2_AXIS_WHEEL]	= __ATTR(wheel, 0644, tmff2_axis_show, tmff2_axis_store),
+	[TMFF2_AXIS_THROTTLE]	= __ATTR(throttle, 0644, tmff2_axis_show, tmff2_axis_store),
+	[TMFF2_AXIS_BRAKE]	= __ATTR(brake, 0644, tmff2_axis_show, tmff2_axis_store),
+	[TMFF2_AXIS_CLUTCH]	= __ATTR(clutch, 0644, tmff2_axis_show, tmff2_axis_store),
+};
+
+static struct attribute *tmff2_calibration_attrs[] = {
+	&tmff2_axis_attrs[TMFF2_AXIS_WHEEL].attr,
+	&tmff2_axis_attrs[TMFF2_AXIS_THROTTLE].attr,
+	&tmff2_axis_attrs[TMFF2_AXIS_BRAKE].attr,
+	&tmff2_axis_attrs[TMFF2_AXIS_CLUTCH].attr,
+	NULL
+};
+
+static const struct attribute_group tmff2_calibration_group = {
+	.name = "calibration",
+	.attrs = tmff2_calibration_attrs,
+};
+
+int tmff2_input_create_files(struct tmff2_device_entry *tmff2)
+{
+	if (!tmff2->input)
+		return 0;
+
+	return sysfs_create_group(&tmff2->hdev->dev.kobj,
+			&tmff2_calibration_group);
+}
+
+void tmff2_input_remove_files(struct tmff2_device_entry *tmff2)
+{
+	if (!tmff2->input)
+		return;
+
+	sysfs_remove_group(&tmff2->hdev->dev.kobj, &tmff2_calibration_group);
+}
+
+static void tmff2_input_account(struct tmff2_input_stats *stats, ktime_t now)
+{
+	u32 interval, delta;
+	int bucket = 0;
+
+	if (!stats->reports++)
+		goto out;
+
+	interval = ktime_us_delta(now, stats->last);
+
+	if (interval >= TMFF2_INTERVAL_BASE_US)
+		bucket = min(ilog2(interval / TMFF2_INTERVAL_BASE_US) + 1,
+				TMFF2_INTERVAL_BUCKETS - 1);
+
+	stats->buckets[bucket]++;
+	stats->total_us += interval;
+
+	if (stats->reports == 2 || interval < stats->min_us)
+		stats->min_us = interval;
+
+	if (interval > stats->max_us)
+		stats->max_us = interval;
+
+	/* smoothed variation between consecutive intervals */
+	if (stats->reports > 2) {
+		delta = abs((s32)(interval - stats->last_us));
+		stats->jitter += delta - ((stats->jitter + 8) >> 4);
+	}
+
+	stats->last_us = interval;
+out:
+	stats->last = now;
+}
+
+static int tmff2_input_intervals_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_input *decoder = m->private;
+	struct tmff2_input_stats *stats = &decoder->stats;
+	u64 intervals = stats->reports > 1 ? stats->reports - 1 : 0;
+	u32 low, high;
+	int i;
+
+	seq_printf(m, "reports: %llu\n", stats->reports);
+
+	if (!intervals)
+		return 0;
+
+	seq_printf(m, "interval min/avg/max: %u/%llu/%u us\n",
+			stats->min_us, div64_u64(stats->total_us, intervals),
+			stats->max_us);
+	seq_printf(m, "jitter: %u us\n", stats->jitter >> 4);
+
+	for (i = 0; i < TMFF2_INTERVAL_BUCKETS; ++i) {
+		low = i ? TMFF2_INTERVAL_BASE_US << (i - 1) : 0;
+		high = TMFF2_INTERVAL_BASE_US << i;
+
+		if (i == TMFF2_INTERVAL_BUCKETS - 1)
+			seq_printf(m, "%6u-     us: %llu\n", low,
+					stats->buckets[i]);
+		else
+			seq_printf(m, "%6u-%-6u us: %llu\n", low, high,
+					stats->buckets[i]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_input_intervals);
+
+void tmff2_input_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir)
+{
+	if (!tmff2->input)
+		return;
+
+	debugfs_create_file("input_intervals", 0444, dir, tmff2->input,
+			&tmff2_input_intervals_fops);
+}
+
+/* called by hid-input before the input device is registered, the only
+ * point where new capabilities are still picked up by everyone */
+int tmff2_input_configured(struct hid_device *hdev, struct hid_input *hi)
+{
+	input_set_capability(hi->input, EV_MSC, MSC_TIMESTAMP);
+	return 0;
+}
+
+static void tmff2_input_hat(struct input_dev *input,
+		const struct tmff2_input_usage *u, __s32 value)
+{
+	int hat_dir = u->hat_dir;
+
+	if (!hat_dir)
+		hat_dir = (value - u->hat_min) * 8 / (u->hat_max - u->hat_min + 1) + 1;
+
+	if (hat_dir < 0 || hat_dir > 8)
+		hat_dir = 0;
+
+	input_event(input, u->type, u->code, tmff2_hat_to_axis[hat_dir].x);
+	input_event(input, u->type, u->code + 1, tmff2_hat_to_axis[hat_dir].y);
+}
+
+/* decode report straight into input events, mirroring what hid-input would
+ * do with it. Returns 0 if the report should go through the generic path,
+ * TMFF2_INPUT_CONSUMED if it was fully handled here. */
+int tmff2_input_raw_event(struct tmff2_device_entry *tmff2,
+		struct hid_report *report, u8 *data, int size)
+{
+	struct tmff2_input *decoder = smp_load_acquire(&tmff2->input);
+	const struct tmff2_input_usage *u;
+	struct input_dev *input;
+	ktime_t now = ktime_get();
+	u8 *raw = data;
+	int raw_size = size;
+	__s32 value;
+	int i;
+
+	if (!decoder || report->id != decoder->report_id)
+		return 0;
+
+	tmff2_input_account(&decoder->stats, now);
+
+	if (report->id) {
+		data++;
+		size--;
+	}
+
+	/* short reports get zero padded by hid-core, let it deal with them */
+	if (size < (int)decoder->length)
+		return 0;
+
+	tmff2_input_apply_calibration(tmff2, decoder, data);
+
+	/* stamp the events with the arrival time of the report rather than
+	 * whenever they get through the input core. Either path syncs the
+	 * frame after this, so the timestamp ends up in the same frame as the
+	 * values. */
+	input = decoder->input;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+	input_set_timestamp(input, now);
+#endif
+	input_event(input, EV_MSC, MSC_TIMESTAMP, (u32)ktime_to_us(now));
+
+	if (!decoder->direct)
+		return 0;
+
+	for (i = 0; i < decoder->count; ++i) {
+		u = &decoder->usages[i];
+
+		value = hid_field_extract(tmff2->hdev, data, u->offset, u->size);
+		if (u->is_signed)
+			value = sign_extend32(value, u->size - 1);
+
+		if (u->is_hat) {
+			tmff2_input_hat(input, u, value);
+			continue;
+		}
+
+		if (u->null_state && (value < u->logical_minimum
+					|| value > u->logical_maximum))
+			continue;
+
+		/* report the usage code as scancode if the key status has
+		 * changed, like hid-input */
+		if (u->type == EV_KEY && (!test_bit(u->code, input->key)) == value)
+			input_event(input, EV_MSC, MSC_SCAN, u->hid);
+
+		input_event(input, u->type, u->code, value);
+	}
+
+	input_sync(input);
+
+#if IS_ENABLED(CONFIG_HIDRAW)
+	/* the generic path is skipped entirely, so hidraw has to be fed here */
+	if (tmff2->hdev->claimed & HID_CLAIMED_HIDRAW)
+		hidraw_report_event(tmff2->hdev, raw, raw_size);
+#endif
+
+	return TMFF2_INPUT_CONSUMED;
+}
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef __HID_TMFF2_SCHED_H
+#define __HID_TMFF2_SCHED_H
+
+/* effect slot state machine shared by the work handler and the ff-core
+ * callbacks. It only uses bitops, fixed size types and smp_mb__before_atomic,
+ * so that it can be built in userspace as well, see tools/tmff2-sim.c. The
+ * userspace shim provides those before including this file. */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/bitops.h>
+#endif
+
+#define FF_EFFECT_QUEUE_UPLOAD	0
+#define FF_EFFECT_QUEUE_START	1
+#define FF_EFFECT_QUEUE_STOP	2
+#define FF_EFFECT_QUEUE_UPDATE	3
+#define FF_EFFECT_PLAYING	4
+
+/* replay timing of an effect as last requested by ff-core, in Linux format */
+struct tmff2_effect_timing {
+	__u32 count;
+	__u32 start_time;
+	__u16 delay;
+	__u16 length;
+};
+
+/* ff-core side, the caller has already published the effect and its timing
+ * so order that before the request bits */
+static inline void tmff2_sched_request_upload(unsigned long *flags, bool update)
+{
+	smp_mb__before_atomic();
+	if (update)
+		set_bit(FF_EFFECT_QUEUE_UPDATE, flags);
+	else
+		set_bit(FF_EFFECT_QUEUE_UPLOAD, flags);
+}
+
+static inline void tmff2_sched_request_play(unsigned long *flags, int value)
+{
+	smp_mb__before_atomic();
+	if (value > 0) {
+		clear_bit(FF_EFFECT_QUEUE_STOP, flags);
+		set_bit(FF_EFFECT_QUEUE_START, flags);
+	} else {
+		clear_bit(FF_EFFECT_QUEUE_START, flags);
+		set_bit(FF_EFFECT_QUEUE_STOP, flags);
+	}
+}
+
+/* work handler side, take the requests of a slot and keep log of what actions
+ * to take. The requests have to be taken before reading the timing latch, so
+ * anything published after this point sets them again for the next tick. */
+static inline unsigned long tmff2_sched_take(unsigned long *flags)
+{
+	unsigned long actions = 0;
+
+	if (test_and_clear_bit(FF_EFFECT_QUEUE_UPLOAD, flags)) {
+		__set_bit(FF_EFFECT_QUEUE_UPLOAD, &actions);
+		/* if we're uploading an effect, it's bound to be up
+		 * to date */
+		clear_bit(FF_EFFECT_QUEUE_UPDATE, flags);
+	}
+
+	if (test_and_clear_bit(FF_EFFECT_QUEUE_UPDATE, flags))
+		__set_bit(FF_EFFECT_QUEUE_UPDATE, &actions);
+
+	if (test_and_clear_bit(FF_EFFECT_QUEUE_START, flags))
+		__set_bit(FF_EFFECT_QUEUE_START, &actions);
+
+	if (test_and_clear_bit(FF_EFFECT_QUEUE_STOP, flags))
+		__set_bit(FF_EFFECT_QUEUE_STOP, &actions);
+
+	return actions;
+}
+
+/* move the playing state of a slot to time_now (in ms), given the actions
+ * just taken. Updates to an effect that ran out are dropped from actions.
+ * Returns true while the effect is playing, i.e. the slot needs more ticks
+ * since it might expire or get updated. */
+static inline bool tmff2_sched_advance(unsigned long *flags,
+		unsigned long *actions, const struct tmff2_effect_timing *timing,
+		__u32 time_now)
+{
+	if (test_bit(FF_EFFECT_PLAYING, flags) && timing->length
+			&& !test_bit(FF_EFFECT_QUEUE_START, actions)) {
+		if ((__u32)(time_now - timing->start_time) >=
+				(__u64)(timing->delay + timing->length) * timing->count) {
+			clear_bit(FF_EFFECT_PLAYING, flags);
+			__clear_bit(FF_EFFECT_QUEUE_UPDATE, actions);
+		}
+	}
+
+	/* effect is playing since we're started it right now */
+	if (test_bit(FF_EFFECT_QUEUE_START, actions))
+		set_bit(FF_EFFECT_PLAYING, flags);
+
+	/* the effect can't be playing if we're stopped, aye? */
+	if (test_bit(FF_EFFECT_QUEUE_STOP, actions))
+		clear_bit(FF_EFFECT_PLAYING, flags);
+
+	return test_bit(FF_EFFECT_PLAYING, flags);
+}
+
+#endif /* __HID_TMFF2_SCHED_H */
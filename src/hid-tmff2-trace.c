@@ -0,0 +1,287 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <linux/module.h>
+#include <linux/hid.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include "hid-tmff2.h"
+#include "hid-tmff2-uapi.h"
+
+/* ff-core calls come in under ff->mutex (upload) or the input core's
+ * event_lock (everything else), so records are serialised with a lock of
+ * our own. There is a single reader at a time, which kfifo allows to run
+ * without the writer lock. */
+#define TMFF2_TRACE_SIZE	(256 * 1024)
+
+struct tmff2_trace {
+	spinlock_t lock;
+	/* serialises readers against starting a new recording */
+	struct mutex read_lock;
+	struct kfifo fifo;
+	u64 start;
+	unsigned long records;
+	unsigned long dropped;
+};
+
+int tmff2_trace_init(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_trace *trace;
+
+	trace = kzalloc(sizeof(*trace), GFP_KERNEL);
+	if (!trace)
+		return -ENOMEM;
+
+	spin_lock_init(&trace->lock);
+	mutex_init(&trace->read_lock);
+	tmff2->trace = trace;
+	return 0;
+}
+
+void tmff2_trace_destroy(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_trace *trace = tmff2->trace;
+
+	if (!trace)
+		return;
+
+	WRITE_ONCE(tmff2->tracing, false);
+	tmff2->trace = NULL;
+
+	/* fifo is only allocated once the first recording is started */
+	if (kfifo_initialized(&trace->fifo))
+		kfifo_free(&trace->fifo);
+
+	mutex_destroy(&trace->read_lock);
+	kfree(trace);
+}
+
+static void tmff2_trace_put(struct tmff2_device_entry *tmff2,
+		struct tmff2_trace_record *record,
+		const struct tmff2_trace_effect *effect)
+{
+	struct tmff2_trace *trace = tmff2->trace;
+	unsigned int len = sizeof(*record) + (effect ? sizeof(*effect) : 0);
+	unsigned long flags;
+
+	spin_lock_irqsave(&trace->lock, flags);
+	if (!tmff2->tracing)
+		goto out;
+
+	/* drop whole records, a partial one would desync the stream */
+	if (kfifo_avail(&trace->fifo) < len) {
+		trace->dropped++;
+		goto out;
+	}
+
+	record->time_ns = ktime_get_ns() - trace->start;
+	kfifo_in(&trace->fifo, record, sizeof(*record));
+	if (effect)
+		kfifo_in(&trace->fifo, effect, sizeof(*effect));
+
+	trace->records++;
+out:
+	spin_unlock_irqrestore(&trace->lock, flags);
+}
+
+void tmff2_trace_upload(struct tmff2_device_entry *tmff2,
+		const struct ff_effect *effect, bool update)
+{
+	struct tmff2_trace_record record = {
+		.type = TMFF2_TRACE_UPLOAD,
+		.update = update,
+		.id = effect->id,
+	};
+	struct tmff2_trace_effect e = {
+		.type = effect->type,
+		.id = effect->id,
+		.direction = effect->direction,
+		.trigger_button = effect->trigger.button,
+		.trigger_interval = effect->trigger.interval,
+		.replay_length = effect->replay.length,
+		.replay_delay = effect->replay.delay,
+	};
+
+	switch (effect->type) {
+	case FF_CONSTANT:
+		e.u.constant = effect->u.constant;
+		break;
+	case FF_RAMP:
+		e.u.ramp = effect->u.ramp;
+		break;
+	case FF_PERIODIC:
+		e.u.periodic.waveform = effect->u.periodic.waveform;
+		e.u.periodic.period = effect->u.periodic.period;
+		e.u.periodic.magnitude = effect->u.periodic.magnitude;
+		e.u.periodic.offset = effect->u.periodic.offset;
+		e.u.periodic.phase = effect->u.periodic.phase;
+		e.u.periodic.envelope = effect->u.periodic.envelope;
+		break;
+	case FF_SPRING:
+	case FF_DAMPER:
+	case FF_FRICTION:
+	case FF_INERTIA:
+		e.u.condition[0] = effect->u.condition[0];
+		e.u.condition[1] = effect->u.condition[1];
+		break;
+	case FF_RUMBLE:
+		e.u.rumble = effect->u.rumble;
+		break;
+	}
+
+	tmff2_trace_put(tmff2, &record, &e);
+}
+
+/* the other way around, for effects that come in through TMFF2_IOC_BATCH */
+void tmff2_trace_to_effect(const struct tmff2_trace_effect *e,
+		struct ff_effect *effect)
+{
+	memset(effect, 0, sizeof(*effect));
+	effect->type = e->type;
+	effect->id = e->id;
+	effect->direction = e->direction;
+	effect->trigger.button = e->trigger_button;
+	effect->trigger.interval = e->trigger_interval;
+	effect->replay.length = e->replay_length;
+	effect->replay.delay = e->replay_delay;
+
+	switch (e->type) {
+	case FF_CONSTANT:
+		effect->u.constant = e->u.constant;
+		break;
+	case FF_RAMP:
+		effect->u.ramp = e->u.ramp;
+		break;
+	case FF_PERIODIC:
+		effect->u.periodic.waveform = e->u.periodic.waveform;
+		effect->u.periodic.period = e->u.periodic.period;
+		effect->u.periodic.magnitude = e->u.periodic.magnitude;
+		effect->u.periodic.offset = e->u.periodic.offset;
+		effect->u.periodic.phase = e->u.periodic.phase;
+		effect->u.periodic.envelope = e->u.periodic.envelope;
+		break;
+	case FF_SPRING:
+	case FF_DAMPER:
+	case FF_FRICTION:
+	case FF_INERTIA:
+		effect->u.condition[0] = e->u.condition[0];
+		effect->u.condition[1] = e->u.condition[1];
+		break;
+	case FF_RUMBLE:
+		effect->u.rumble = e->u.rumble;
+		break;
+	}
+}
+
+void tmff2_trace_event(struct tmff2_device_entry *tmff2, u8 type,
+		s16 id, s32 value)
+{
+	struct tmff2_trace_record record = {
+		.type = type,
+		.id = id,
+		.value = value,
+	};
+
+	tmff2_trace_put(tmff2, &record, NULL);
+}
+
+static int tmff2_trace_start(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_trace *trace = tmff2->trace;
+	struct tmff2_trace_header header = {
+		.magic = TMFF2_TRACE_MAGIC,
+		.version = TMFF2_TRACE_VERSION,
+		.max_effects = tmff2->max_effects,
+		.vendor = tmff2->hdev->vendor,
+		.product = tmff2->hdev->product,
+	};
+	unsigned long flags;
+	int ret;
+
+	if ((ret = mutex_lock_interruptible(&trace->read_lock)))
+		return ret;
+
+	if (!kfifo_initialized(&trace->fifo) &&
+			(ret = kfifo_alloc(&trace->fifo, TMFF2_TRACE_SIZE,
+					   GFP_KERNEL)))
+		goto out;
+
+	/* restarting throws away whatever wasn't read yet */
+	spin_lock_irqsave(&trace->lock, flags);
+	kfifo_reset(&trace->fifo);
+	kfifo_in(&trace->fifo, &header, sizeof(header));
+	trace->records = 0;
+	trace->dropped = 0;
+	trace->start = ktime_get_ns();
+	WRITE_ONCE(tmff2->tracing, true);
+	spin_unlock_irqrestore(&trace->lock, flags);
+
+out:
+	mutex_unlock(&trace->read_lock);
+	return ret;
+}
+
+static int tmff2_trace_record_get(void *data, u64 *val)
+{
+	struct tmff2_device_entry *tmff2 = data;
+
+	*val = READ_ONCE(tmff2->tracing);
+	return 0;
+}
+
+static int tmff2_trace_record_set(void *data, u64 val)
+{
+	struct tmff2_device_entry *tmff2 = data;
+
+	if (val)
+		return tmff2_trace_start(tmff2);
+
+	/* stopping keeps the fifo contents around for reading */
+	WRITE_ONCE(tmff2->tracing, false);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(tmff2_trace_record_fops, tmff2_trace_record_get,
+		tmff2_trace_record_set, "%llu\n");
+
+/* reading drains the fifo and returns 0 once it is empty, so a recording can
+ * be collected with something like
+ *	while :; do cat trace; sleep 1; done > session.bin */
+static ssize_t tmff2_trace_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct tmff2_trace *trace = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	if ((ret = mutex_lock_interruptible(&trace->read_lock)))
+		return ret;
+
+	if (kfifo_initialized(&trace->fifo))
+		ret = kfifo_to_user(&trace->fifo, buf, count, &copied);
+	else
+		copied = 0;
+
+	mutex_unlock(&trace->read_lock);
+	return ret ? ret : copied;
+}
+
+static const struct file_operations tmff2_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = tmff2_trace_read,
+	.llseek = noop_llseek,
+};
+
+void tmff2_trace_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir)
+{
+	struct tmff2_trace *trace = tmff2->trace;
+
+	if (!trace)
+		return;
+
+	debugfs_create_file_unsafe("record", 0600, dir, tmff2,
+			&tmff2_trace_record_fops);
+	debugfs_create_file("trace", 0400, dir, trace, &tmff2_trace_fops);
+	debugfs_create_ulong("trace_records", 0444, dir, &trace->records);
+	debugfs_create_ulong("trace_dropped", 0444, dir, &trace->dropped);
+}
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+#ifndef __HID_TMFF2_UAPI_H
+#define __HID_TMFF2_UAPI_H
+
+/* definitions shared with userspace tools, only depends on uapi headers */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/input.h>
+
+/* ff-core session traces, read from debugfs tmff2/<device>/trace while
+ * recording is enabled through tmff2/<device>/record.
+ *
+ * The stream starts with a struct tmff2_trace_header, followed by records.
+ * Every record starts with a struct tmff2_trace_record, upload records are
+ * followed by a struct tmff2_trace_effect. Everything is in host byte order,
+ * traces are meant to be replayed on the machine they were recorded on or
+ * one like it. */
+#define TMFF2_TRACE_MAGIC	0x32464d54	/* "TMF2" */
+#define TMFF2_TRACE_VERSION	1
+
+struct tmff2_trace_header {
+	__u32 magic;
+	__u16 version;
+	__u16 max_effects;
+	__u32 vendor;
+	__u32 product;
+};
+
+enum tmff2_trace_type {
+	TMFF2_TRACE_UPLOAD = 1,
+	TMFF2_TRACE_PLAY,
+	TMFF2_TRACE_GAIN,
+	TMFF2_TRACE_AUTOCENTER,
+};
+
+struct tmff2_trace_record {
+	__u64 time_ns;	/* since recording was started */
+	__u8 type;	/* enum tmff2_trace_type */
+	__u8 update;	/* upload replaced an existing effect */
+	__s16 id;	/* effect id, -1 for gain and autocenter */
+	__s32 value;	/* play count, gain or autocenter */
+};
+
+/* struct ff_effect without the custom_data pointer, so that the layout
+ * doesn't depend on the word size */
+struct tmff2_trace_effect {
+	__u16 type;
+	__s16 id;
+	__u16 direction;
+	__u16 trigger_button;
+	__u16 trigger_interval;
+	__u16 replay_length;
+	__u16 replay_delay;
+	__u16 reserved;
+
+	union {
+		struct ff_constant_effect constant;
+		struct ff_ramp_effect ramp;
+		struct {
+			__u16 waveform;
+			__u16 period;
+			__s16 magnitude;
+			__s16 offset;
+			__u16 phase;
+			struct ff_envelope envelope;
+		} periodic;
+		struct ff_condition_effect condition[2];
+		struct ff_rumble_effect rumble;
+	} u;
+};
+
+/* batched effect updates, TMFF2_IOC_BATCH on the raw command device
+ * /dev/tmff2-<n>. Each entry updates the parameters of an effect, plays or
+ * stops it, or both. Effects have to be uploaded with EVIOCSFF by the calling
+ * process first, effect.id is the id EVIOCSFF returned and the type of an
+ * effect can't change. Either all entries are applied or none are. */
+#define TMFF2_BATCH_UPDATE	(1 << 0)
+#define TMFF2_BATCH_PLAY	(1 << 1)
+#define TMFF2_BATCH_FLAGS	(TMFF2_BATCH_UPDATE | TMFF2_BATCH_PLAY)
+#define TMFF2_BATCH_MAX		64
+
+struct tmff2_batch_entry {
+	__u32 flags;
+	__s32 value;	/* with TMFF2_BATCH_PLAY, play count or 0 to stop */
+	struct tmff2_trace_effect effect;
+};
+
+struct tmff2_batch {
+	__u32 count;
+	__u32 reserved;
+	__u64 entries;	/* pointer to count struct tmff2_batch_entry */
+};
+
+#define TMFF2_IOC_MAGIC		0xe9
+#define TMFF2_IOC_BATCH		_IOW(TMFF2_IOC_MAGIC, 0x01, struct tmff2_batch)
+
+/* torque streaming, with the torque_stream module parameter set. mmap the
+ * first page of /dev/tmff2-<n> shared and store levels into it: write level,
+ * then increment seq with release semantics. While the page is mapped the
+ * driver plays a constant force in a slot of its own and sends the latest
+ * level on every tick, older ones are overwritten. sent is the seq of the
+ * last level that went out. */
+struct tmff2_stream_mailbox {
+	__u32 seq;
+	__s16 level;	/* like ff_constant_effect.level, east is positive */
+	__u16 reserved;
+	__u32 sent;
+};
+
+#endif /* __HID_TMFF2_UAPI_H */
@@ -1,9 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 #include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/module.h>
 #include <linux/hid.h>
+#include <linux/usb.h>
 #include <linux/version.h>
 #include "hid-tmff2.h"
+#include "hid-tmff2-uapi.h"
 
 
 int open_mode = 1;
@@ -16,39 +20,80 @@ module_param(timer_msecs, int, 0660);
 MODULE_PARM_DESC(timer_msecs,
 		"Timer resolution in msecs");
 
+int hid_bpf_output;
+module_param(hid_bpf_output, int, 0660);
+MODULE_PARM_DESC(hid_bpf_output,
+		"Send commands with hid_hw_output_report, so HID-BPF programs can rewrite them (6.11+)");
+
+int pack_commands;
+module_param(pack_commands, int, 0660);
+MODULE_PARM_DESC(pack_commands,
+		"Send short commands several to a report, unsafe: commands the firmware drops go undetected");
+
+static int idle_msecs;
+module_param(idle_msecs, int, 0660);
+MODULE_PARM_DESC(idle_msecs,
+		"Close the wheel after this many msecs with nothing playing, 0 to never close it");
+
+static int torque_stream;
+module_param(torque_stream, int, 0);
+MODULE_PARM_DESC(torque_stream,
+		"Reserve an effect slot for torque streamed through /dev/tmff2-<n>");
+
 /* should these be removed and just rely on /sys? */
-int spring_level = 30;
+static int spring_level = 30;
 module_param(spring_level, int, 0);
 MODULE_PARM_DESC(spring_level,
 		"Level of spring force (0-100), as per Oversteer standards");
 
-int damper_level = 30;
+static int damper_level = 30;
 module_param(damper_level, int, 0);
 MODULE_PARM_DESC(damper_level,
 		"Level of damper force (0-100), as per Oversteer standards");
 
-int friction_level = 30;
+static int friction_level = 30;
 module_param(friction_level, int, 0);
 MODULE_PARM_DESC(friction_level,
 		"Level of friction force (0-100), as per Oversteer standards");
 
-int range = 900;
+static int range = 900;
 module_param(range, int, 0);
 MODULE_PARM_DESC(range,
 		"Range of wheel, depends on the wheel. Invalid values are ignored");
 
-int alt_mode = 0;
+static int alt_mode = 0;
 module_param(alt_mode, int, 0);
 MODULE_PARM_DESC(alt_mode,
 		"Alternate mode, eg. F1 mode");
 
 #define GAIN_MAX 65535
-int gain = 40000;
+static int gain = 40000;
 module_param(gain, int, 0);
 MODULE_PARM_DESC(gain,
 		"Level of gain (0-65535)");
 
-static spinlock_t lock;
+static DEFINE_SPINLOCK(lock);
+static struct dentry *tmff2_debugfs_root;
+
+static void tmff2_queue_command(struct tmff2_device_entry *tmff2,
+		enum tmff2_command command);
+
+/* profiles written through sysfs, kept around so that a wheel that is
+ * unplugged and plugged back in gets its settings back. Keyed by
+ * vendor/product and the serial (uniq) if the wheel reports one. */
+#define TMFF2_MAX_PROFILES 16
+
+struct tmff2_profile {
+	struct list_head list;
+	__u32 vendor;
+	__u32 product;
+	char uniq[64];
+	struct tmff2_settings settings;
+};
+
+static LIST_HEAD(tmff2_profiles);
+static unsigned int tmff2_nr_profiles;
+static DEFINE_MUTEX(tmff2_profiles_lock);
 
 static struct tmff2_device_entry *tmff2_from_hdev(struct hid_device *hdev)
 {
@@ -81,9 +126,14 @@ static struct tmff2_device_entry *tmff2_from_input(struct input_dev *input_dev)
 static ssize_t spring_level_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	unsigned long flags;
 	unsigned int value;
 	int ret;
 
+	if (!tmff2)
+		return -ENODEV;
+
 	ret = kstrtouint(buf, 0, &value);
 	if (ret) {
 		dev_err(dev, "kstrtouint failed at spring_level_store: %i", ret);
@@ -95,7 +145,9 @@ static ssize_t spring_level_store(struct device *dev,
 		value = 100;
 	}
 
-	spring_level = value;
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings.spring_level = value;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
 
 	return count;
 }
@@ -103,16 +155,26 @@ static ssize_t spring_level_store(struct device *dev,
 static ssize_t spring_level_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	return scnprintf(buf, PAGE_SIZE, "%u\n", spring_level);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+
+	if (!tmff2)
+		return -ENODEV;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", tmff2->settings.spring_level);
 }
 static DEVICE_ATTR_RW(spring_level);
 
 static ssize_t damper_level_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	unsigned long flags;
 	unsigned int value;
 	int ret;
 
+	if (!tmff2)
+		return -ENODEV;
+
 
 	ret = kstrtouint(buf, 0, &value);
 	if (ret) {
@@ -125,7 +187,9 @@ static ssize_t damper_level_store(struct device *dev,
 		value = 100;
 	}
 
-	damper_level = value;
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings.damper_level = value;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
 
 	return count;
 }
@@ -133,16 +197,26 @@ static ssize_t damper_level_store(struct device *dev,
 static ssize_t damper_level_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	return scnprintf(buf, PAGE_SIZE, "%u\n", damper_level);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+
+	if (!tmff2)
+		return -ENODEV;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", tmff2->settings.damper_level);
 }
 static DEVICE_ATTR_RW(damper_level);
 
 static ssize_t friction_level_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	unsigned long flags;
 	unsigned int value;
 	int ret;
 
+	if (!tmff2)
+		return -ENODEV;
+
 
 	ret = kstrtouint(buf, 0, &value);
 	if (ret) {
@@ -155,7 +229,9 @@ static ssize_t friction_level_store(struct device *dev,
 		value = 100;
 	}
 
-	friction_level = value;
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings.friction_level = value;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
 
 	return count;
 }
@@ -163,7 +239,12 @@ static ssize_t friction_level_store(struct device *dev,
 static ssize_t friction_level_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	return scnprintf(buf, PAGE_SIZE, "%u\n", friction_level);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+
+	if (!tmff2)
+		return -ENODEV;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", tmff2->settings.friction_level);
 }
 static DEVICE_ATTR_RW(friction_level);
 
@@ -171,6 +252,7 @@ static ssize_t range_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	unsigned long flags;
 	unsigned int value;
 	int ret;
 
@@ -182,18 +264,35 @@ static ssize_t range_store(struct device *dev,
 		return ret;
 	}
 
-	if (tmff2->set_range) {
-		if ((ret = tmff2->set_range(tmff2->data, value)))
-			return ret;
+	if (value < tmff2->range_min) {
+		dev_info(dev, "value %u smaller than min %u, clamping to %u.\n",
+				value, tmff2->range_min, tmff2->range_min);
+		value = tmff2->range_min;
 	}
 
+	if (value > tmff2->range_max) {
+		dev_info(dev, "value %u larger than max %u, clamping to %u.\n",
+				value, tmff2->range_max, tmff2->range_max);
+		value = tmff2->range_max;
+	}
+
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings.range = value;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
+	tmff2_queue_command(tmff2, TMFF2_CMD_RANGE);
+
 	return count;
 }
 
 static ssize_t range_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	return scnprintf(buf, PAGE_SIZE, "%u\n", range);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+
+	if (!tmff2)
+		return -ENODEV;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", tmff2->settings.range);
 }
 static DEVICE_ATTR_RW(range);
 
@@ -230,6 +329,7 @@ static ssize_t gain_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	unsigned long flags;
 	unsigned int value;
 	int ret;
 
@@ -241,9 +341,10 @@ static ssize_t gain_store(struct device *dev,
 		return ret;
 	}
 
-	gain = value;
-	if (tmff2->set_gain) /* if we can, update gain immediately */
-		tmff2->set_gain(tmff2->data, (GAIN_MAX * gain) / GAIN_MAX);
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings.gain = value;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
+	tmff2_queue_command(tmff2, TMFF2_CMD_GAIN);
 
 	return count;
 }
@@ -251,7 +352,12 @@ static ssize_t gain_store(struct device *dev,
 static ssize_t gain_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
-	return scnprintf(buf, PAGE_SIZE, "%i\n", gain);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+
+	if (!tmff2)
+		return -ENODEV;
+
+	return scnprintf(buf, PAGE_SIZE, "%i\n", tmff2->settings.gain);
 }
 static DEVICE_ATTR_RW(gain);
 
@@ -262,263 +368,1407 @@ static void tmff2_set_gain(struct input_dev *dev, uint16_t value)
 	if (!tmff2)
 		return;
 
-	if (!tmff2->set_gain) {
-		hid_err(tmff2->hdev, "missing set_gain\n");
-		return;
-	}
+	if (unlikely(tmff2->tracing))
+		tmff2_trace_event(tmff2, TMFF2_TRACE_GAIN, -1, value);
 
-	if (tmff2->set_gain(tmff2->data, (value * gain) / GAIN_MAX))
-		hid_warn(tmff2->hdev, "unable to set gain\n");
+	tmff2->ff_gain = value;
+	tmff2_queue_command(tmff2, TMFF2_CMD_GAIN);
 }
 
 static void tmff2_set_autocenter(struct input_dev *dev, uint16_t value)
 {
 	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+	unsigned long flags;
 
 	if (!tmff2)
 		return;
 
-	if (!tmff2->set_autocenter) {
-		hid_err(tmff2->hdev, "missing set_autocenter\n");
+	if (unlikely(tmff2->tracing))
+		tmff2_trace_event(tmff2, TMFF2_TRACE_AUTOCENTER, -1, value);
+
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings.autocenter = value;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
+	tmff2_queue_command(tmff2, TMFF2_CMD_AUTOCENTER);
+}
+
+/* effect command dispatch, the T300RS family is by far the common case so
+ * call into it directly and only fall back to the callbacks for other
+ * families */
+static inline int tmff2_normalise_effect(struct tmff2_device_entry *tmff2,
+		const struct ff_effect *effect, struct tmff2_effect_params *params)
+{
+	if (likely(tmff2->family == TMFF2_FAMILY_T300RS))
+		return t300rs_normalise_effect(tmff2->data, effect, params);
+
+	return tmff2->normalise_effect(tmff2->data, effect, params);
+}
+
+static inline int tmff2_play_effect(struct tmff2_device_entry *tmff2,
+		int id, unsigned long count)
+{
+	if (likely(tmff2->family == TMFF2_FAMILY_T300RS))
+		return t300rs_play_effect(tmff2->data, id, count);
+
+	return tmff2->play_effect(tmff2->data, id, count);
+}
+
+static inline int tmff2_upload_effect(struct tmff2_device_entry *tmff2,
+		int id, const struct tmff2_effect_params *effect)
+{
+	if (likely(tmff2->family == TMFF2_FAMILY_T300RS))
+		return t300rs_upload_effect(tmff2->data, id, effect);
+
+	return tmff2->upload_effect(tmff2->data, id, effect);
+}
+
+static inline int tmff2_update_effect(struct tmff2_device_entry *tmff2,
+		int id, const struct tmff2_effect_params *effect,
+		const struct tmff2_effect_params *old)
+{
+	if (likely(tmff2->family == TMFF2_FAMILY_T300RS))
+		return t300rs_update_effect(tmff2->data, id, effect, old);
+
+	return tmff2->update_effect(tmff2->data, id, effect, old);
+}
+
+static inline int tmff2_stop_effect(struct tmff2_device_entry *tmff2, int id)
+{
+	if (likely(tmff2->family == TMFF2_FAMILY_T300RS))
+		return t300rs_stop_effect(tmff2->data, id);
+
+	return tmff2->stop_effect(tmff2->data, id);
+}
+
+/* send whatever the backend held back to pack, only the T300RS family does */
+static inline int tmff2_flush_commands(struct tmff2_device_entry *tmff2)
+{
+	if (likely(tmff2->family == TMFF2_FAMILY_T300RS))
+		return t300rs_flush(tmff2->data);
+
+	return 0;
+}
+
+/* latch helpers, timing writers hold the slot's lock and parameter writers
+ * ff->mutex */
+static void tmff2_publish_timing(struct tmff2_effect_state *state,
+		const struct tmff2_effect_timing *timing)
+{
+	raw_write_seqcount_latch(&state->seq);
+	state->timing[0] = *timing;
+	raw_write_seqcount_latch(&state->seq);
+	state->timing[1] = *timing;
+}
+
+static void tmff2_read_timing(struct tmff2_effect_state *state,
+		struct tmff2_effect_timing *timing)
+{
+	unsigned int seq;
+
+	do {
+		seq = raw_read_seqcount_latch(&state->seq);
+		*timing = state->timing[seq & 1];
+	} while (read_seqcount_retry(&state->seq.seqcount, seq));
+}
+
+static void tmff2_publish_params(struct tmff2_effect_payload *payload,
+		const struct tmff2_effect_params *params)
+{
+	raw_write_seqcount_latch(&payload->seq);
+	payload->effect[0] = *params;
+	raw_write_seqcount_latch(&payload->seq);
+	payload->effect[1] = *params;
+}
+
+static void tmff2_read_params(struct tmff2_effect_payload *payload,
+		struct tmff2_effect_params *params)
+{
+	unsigned int seq;
+
+	do {
+		seq = raw_read_seqcount_latch(&payload->seq);
+		*params = payload->effect[seq & 1];
+	} while (read_seqcount_retry(&payload->seq.seqcount, seq));
+}
+
+/* value is updated to what the wheel was actually sent */
+static int tmff2_send_command(struct tmff2_device_entry *tmff2,
+		enum tmff2_command command, int *value)
+{
+	int ret;
+
+	switch (command) {
+		case TMFF2_CMD_RANGE:
+			if ((ret = tmff2->set_range(tmff2->data, *value)) < 0)
+				return ret;
+
+			*value = ret;
+			return 0;
+		case TMFF2_CMD_GAIN:
+			return tmff2->set_gain(tmff2->data, *value);
+		case TMFF2_CMD_AUTOCENTER:
+			return tmff2->set_autocenter(tmff2->data, *value);
+		default:
+			return -EINVAL;
+	}
+}
+
+/* failed sends are retried after timer_msecs, doubling every attempt. Returns
+ * false once the target is given up on. */
+static bool tmff2_retry_later(struct tmff2_device_entry *tmff2,
+		unsigned int *retries, unsigned long *retry_at,
+		const char *what, int id)
+{
+	if (*retries > TMFF2_MAX_RETRIES)
+		return false;
+
+	if (++*retries > TMFF2_MAX_RETRIES) {
+		hid_err(tmff2->hdev, "%s %i out of sync with the wheel, giving up\n",
+				what, id);
+		return false;
+	}
+
+	*retry_at = jiffies + msecs_to_jiffies(timer_msecs << (*retries - 1));
+	return true;
+}
+
+static bool tmff2_retry_due(unsigned int retries, unsigned long retry_at)
+{
+	return retries && retries <= TMFF2_MAX_RETRIES
+		&& time_after_eq(jiffies, retry_at);
+}
+
+static bool tmff2_commands_retrying(struct tmff2_device_entry *tmff2)
+{
+	int i;
+
+	for (i = 0; i < TMFF2_CMDS; ++i)
+		if (tmff2->commands[i].retries &&
+				tmff2->commands[i].retries <= TMFF2_MAX_RETRIES)
+			return true;
+
+	return false;
+}
+
+/* send whatever out-of-band commands changed since the last tick or are due
+ * for another attempt, back to back, waiting for the output queue only once
+ * at the end. Returns true if a command is still to be retried. */
+static bool tmff2_send_commands(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_command_state *state;
+	struct tmff2_settings settings;
+	int value[TMFF2_CMDS];
+	unsigned long flags;
+	int i, ret, sent = 0;
+	bool requested;
+
+	/* the wheel may have forgotten everything, resend it all */
+	if (test_and_clear_bit(TMFF2_PENDING_SETTINGS, &tmff2->pending)) {
+		for (i = 0; i < TMFF2_CMDS; ++i) {
+			tmff2->commands[i].sent = -1;
+			tmff2->commands[i].retries = 0;
+			set_bit(i, &tmff2->pending);
+		}
+	}
+
+	/* cheap check for the common case of nothing to do */
+	if (!(READ_ONCE(tmff2->pending) & (BIT(TMFF2_CMDS) - 1)) &&
+			!tmff2_commands_retrying(tmff2))
+		return false;
+
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	settings = tmff2->settings;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
+
+	value[TMFF2_CMD_RANGE] = tmff2->set_range ? settings.range : -1;
+	value[TMFF2_CMD_GAIN] = tmff2->set_gain ?
+		(tmff2->ff_gain * settings.gain) / GAIN_MAX : -1;
+	value[TMFF2_CMD_AUTOCENTER] = tmff2->set_autocenter ?
+		settings.autocenter : -1;
+
+	for (i = 0; i < TMFF2_CMDS; ++i) {
+		state = &tmff2->commands[i];
+
+		requested = test_and_clear_bit(i, &tmff2->pending);
+		if (!requested && !tmff2_retry_due(state->retries, state->retry_at))
+			continue;
+
+		if (value[i] < 0)
+			continue;
+
+		if (value[i] == state->sent) {
+			state->nr_unchanged++;
+			state->retries = 0;
+			continue;
+		}
+
+		/* a new value gets a fresh set of attempts */
+		if (requested)
+			state->retries = 0;
+
+		tmff2_fault_begin(tmff2);
+		ret = tmff2_send_command(tmff2, i, &value[i]);
+		tmff2_fault_end(tmff2, &state->diverged, ret);
+
+		if (ret) {
+			hid_warn(tmff2->hdev, "failed sending command %i\n", i);
+			state->sent = -1;
+			tmff2_retry_later(tmff2, &state->retries,
+					&state->retry_at, "command", i);
+			continue;
+		}
+
+		/* the backend clamped the range, e.g. a module parameter out of
+		 * the model's bounds. Keep the settings in line with the wheel
+		 * unless the range was changed again meanwhile. */
+		if (i == TMFF2_CMD_RANGE && value[i] != settings.range) {
+			spin_lock_irqsave(&tmff2->settings_lock, flags);
+			if (tmff2->settings.range == settings.range)
+				tmff2->settings.range = value[i];
+			spin_unlock_irqrestore(&tmff2->settings_lock, flags);
+		}
+
+		state->sent = value[i];
+		state->retries = 0;
+		state->nr_sent++;
+		sent = 1;
+	}
+
+	if (sent)
+		hid_hw_wait(tmff2->hdev);
+
+	return tmff2_commands_retrying(tmff2);
+}
+
+/* keep track of what a slot should hold on the wheel, given the requests just
+ * taken and the playing state they led to */
+static void tmff2_track_slot(struct tmff2_effect_payload *payload,
+		unsigned long actions, bool was_playing, bool playing)
+{
+	if (test_bit(FF_EFFECT_QUEUE_UPLOAD, &actions))
+		__set_bit(TMFF2_SLOT_LOADED, &payload->wanted);
+
+	if (playing)
+		__set_bit(TMFF2_SLOT_PLAYING, &payload->wanted);
+	else
+		__clear_bit(TMFF2_SLOT_PLAYING, &payload->wanted);
+
+	/* ran its course, which it did on the wheel as well */
+	if (was_playing && !playing
+			&& !test_bit(FF_EFFECT_QUEUE_STOP, &actions))
+		__clear_bit(TMFF2_SLOT_PLAYING, &payload->held);
+}
+
+/* send the requested actions for a slot that is in sync with the wheel */
+static int tmff2_run_actions(struct tmff2_device_entry *tmff2, int effect_id,
+		const struct tmff2_effect_timing *timing, unsigned long actions)
+{
+	struct tmff2_effect_payload *payload = &tmff2->payloads[effect_id];
+	struct tmff2_effect_params params;
+	int ret, failed = 0;
+
+	if (test_bit(FF_EFFECT_QUEUE_UPLOAD, &actions)
+			|| test_bit(FF_EFFECT_QUEUE_UPDATE, &actions))
+		tmff2_read_params(payload, &params);
+
+	if (test_bit(FF_EFFECT_QUEUE_UPLOAD, &actions)) {
+		if ((ret = tmff2_upload_effect(tmff2, effect_id, &params))) {
+			hid_warn(tmff2->hdev, "failed uploading effect\n");
+			failed = ret;
+		} else {
+			__set_bit(TMFF2_SLOT_LOADED, &payload->held);
+			payload->sent = params;
+		}
+	}
+
+	if (test_bit(FF_EFFECT_QUEUE_UPDATE, &actions)) {
+		if ((ret = tmff2_update_effect(tmff2, effect_id, &params,
+					&payload->sent))) {
+			hid_warn(tmff2->hdev, "failed updating effect\n");
+			failed = ret;
+		} else {
+			payload->sent = params;
+		}
+	}
+
+	if (test_bit(FF_EFFECT_QUEUE_START, &actions)) {
+		if ((ret = tmff2_play_effect(tmff2, effect_id, timing->count))) {
+			hid_warn(tmff2->hdev, "failed starting effect\n");
+			failed = ret;
+		} else {
+			__set_bit(TMFF2_SLOT_PLAYING, &payload->held);
+		}
+	}
+
+	if (test_bit(FF_EFFECT_QUEUE_STOP, &actions)) {
+		if ((ret = tmff2_stop_effect(tmff2, effect_id))) {
+			hid_warn(tmff2->hdev, "failed stopping effect\n");
+			failed = ret;
+		} else {
+			__clear_bit(TMFF2_SLOT_PLAYING, &payload->held);
+		}
+	}
+
+	return failed;
+}
+
+/* bring a slot that is out of sync back in line, sending only what differs
+ * between the shadow and what the slot should hold. A start request restarts
+ * the effect even if the wheel is already playing it. */
+static int tmff2_resync_slot(struct tmff2_device_entry *tmff2, int effect_id,
+		const struct tmff2_effect_timing *timing, unsigned long actions)
+{
+	struct tmff2_effect_payload *payload = &tmff2->payloads[effect_id];
+	struct tmff2_effect_params params;
+	int ret;
+
+	/* stop whatever raw commands left behind before reusing the slot */
+	if (test_bit(TMFF2_SLOT_RAW, &payload->held)) {
+		if ((ret = tmff2_stop_effect(tmff2, effect_id)))
+			return ret;
+
+		payload->held = 0;
+	}
+
+	if (test_bit(TMFF2_SLOT_LOADED, &payload->wanted)) {
+		tmff2_read_params(payload, &params);
+
+		if (!test_bit(TMFF2_SLOT_LOADED, &payload->held)) {
+			if ((ret = tmff2_upload_effect(tmff2, effect_id, &params)))
+				return ret;
+
+			__set_bit(TMFF2_SLOT_LOADED, &payload->held);
+			payload->sent = params;
+		} else if (memcmp(&params, &payload->sent, sizeof(params))) {
+			if ((ret = tmff2_update_effect(tmff2, effect_id, &params,
+							&payload->sent)))
+				return ret;
+
+			payload->sent = params;
+		}
+	}
+
+	if (test_bit(TMFF2_SLOT_PLAYING, &payload->wanted)) {
+		if (test_bit(TMFF2_SLOT_PLAYING, &payload->held)
+				&& !test_bit(FF_EFFECT_QUEUE_START, &actions))
+			return 0;
+
+		if ((ret = tmff2_play_effect(tmff2, effect_id, timing->count)))
+			return ret;
+
+		__set_bit(TMFF2_SLOT_PLAYING, &payload->held);
+	} else if (test_bit(TMFF2_SLOT_PLAYING, &payload->held)) {
+		if ((ret = tmff2_stop_effect(tmff2, effect_id)))
+			return ret;
+
+		__clear_bit(TMFF2_SLOT_PLAYING, &payload->held);
+	}
+
+	return 0;
+}
+
+static void tmff2_resend_open(struct tmff2_device_entry *tmff2)
+{
+	if (tmff2->send_open && tmff2->send_open(tmff2->data))
+		hid_warn(tmff2->hdev, "failed resending open command\n");
+}
+
+/* the wheel may hold anything, e.g. after a resync was requested through
+ * debugfs. Resend the settings and treat every slot as one failed attempt, so
+ * they're all resynced on this tick. */
+static void tmff2_forget_shadow(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_effect_payload *payload;
+	int effect_id;
+
+	set_bit(TMFF2_PENDING_SETTINGS, &tmff2->pending);
+
+	for (effect_id = 0; effect_id < tmff2->max_effects; ++effect_id) {
+		payload = &tmff2->payloads[effect_id];
+		payload->held &= BIT(TMFF2_SLOT_RAW);
+		payload->retries = 1;
+		payload->retry_at = jiffies;
+		set_bit(FF_EFFECT_RESYNC, &tmff2->states[effect_id].flags);
+	}
+
+	tmff2->stream.loaded = false;
+}
+
+/* the work handler period, rounded up to whole service intervals of the
+ * output endpoint. That only matters for intervals longer than a millisecond,
+ * ticks are not phase locked to the bus, the frames debugfs file just shows
+ * where they end up. */
+static unsigned long tmff2_tick(struct tmff2_device_entry *tmff2)
+{
+	return msecs_to_jiffies(roundup(timer_msecs, tmff2->frames.interval_ms));
+}
+
+static int tmff2_frame_number(struct tmff2_device_entry *tmff2)
+{
+	if (!tmff2->frames.usbdev)
+		return -1;
+
+	return usb_get_current_frame_number(tmff2->frames.usbdev);
+}
+
+/* how many frames the sends of a tick took, and where in the service interval
+ * the tick started. The frame counter wraps at a controller specific value,
+ * ticks that saw it wrap are skipped. */
+static void tmff2_account_frames(struct tmff2_device_entry *tmff2, int start)
+{
+	struct tmff2_frames *frames = &tmff2->frames;
+	int end = tmff2_frame_number(tmff2);
+
+	if (start < 0 || end < start)
+		return;
+
+	frames->ticks++;
+	frames->spans[min(end - start, TMFF2_FRAME_BUCKETS - 1)]++;
+	frames->phases[min_t(unsigned int, start % frames->interval_ms,
+			TMFF2_FRAME_BUCKETS - 1)]++;
+}
+
+/* the wheel was sent the open command and hasn't been closed since */
+static bool tmff2_wheel_open(struct tmff2_device_entry *tmff2)
+{
+	return !tmff2->power.idle && (!open_mode || tmff2->opened);
+}
+
+/* keep the USB link up while force feedback is in use, so that sends don't
+ * wait for the wheel to resume */
+static void tmff2_power_get(struct tmff2_device_entry *tmff2)
+{
+	if (tmff2->power.powered || !tmff2->opened)
+		return;
+
+	if (!hid_hw_power(tmff2->hdev, PM_HINT_FULLON))
+		tmff2->power.powered = true;
+}
+
+static void tmff2_power_put(struct tmff2_device_entry *tmff2)
+{
+	if (!tmff2->power.powered)
+		return;
+
+	hid_hw_power(tmff2->hdev, PM_HINT_NORMAL);
+	tmff2->power.powered = false;
+}
+
+/* anything for the work handler to do besides checking for idleness */
+static bool tmff2_requested(struct tmff2_device_entry *tmff2)
+{
+	const unsigned long requests = BIT(FF_EFFECT_QUEUE_UPLOAD) |
+		BIT(FF_EFFECT_QUEUE_START) | BIT(FF_EFFECT_QUEUE_STOP) |
+		BIT(FF_EFFECT_QUEUE_UPDATE);
+	int effect_id;
+
+	if (READ_ONCE(tmff2->pending) & ~BIT(TMFF2_PENDING_IDLE))
+		return true;
+
+	for (effect_id = 0; effect_id < tmff2->max_effects; ++effect_id)
+		if (READ_ONCE(tmff2->states[effect_id].flags) & requests)
+			return true;
+
+	return false;
+}
+
+/* nothing was sent for idle_msecs, close the wheel and let it suspend */
+static void tmff2_sleep(struct tmff2_device_entry *tmff2)
+{
+	if (tmff2->send_close && tmff2->send_close(tmff2->data))
+		hid_warn(tmff2->hdev, "failed sending close command\n");
+
+	WRITE_ONCE(tmff2->power.idle, true);
+	tmff2->power.idled++;
+	tmff2_power_put(tmff2);
+}
+
+/* something was requested of an idle wheel. Closing it may have reset it, so
+ * open it again and bring everything back in line like for a resync. */
+static void tmff2_wake(struct tmff2_device_entry *tmff2)
+{
+	tmff2_power_get(tmff2);
+	tmff2_resend_open(tmff2);
+	tmff2_forget_shadow(tmff2);
+	clear_bit(TMFF2_PENDING_RESYNC, &tmff2->pending);
+	WRITE_ONCE(tmff2->power.idle, false);
+}
+
+/* from the first request to an idle wheel until the tick that woke it is done
+ * sending */
+static void tmff2_account_wake(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_power *power = &tmff2->power;
+	s64 delta;
+
+	power->woken++;
+	if (!power->wake_request)
 		return;
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), power->wake_request));
+	power->wake_request = 0;
+
+	power->wake_total_ns += delta;
+	if (delta > power->wake_max_ns)
+		power->wake_max_ns = delta;
+}
+
+/* called when a tick leaves nothing playing. Closes the wheel if the idle
+ * timer expired without anything being sent since, otherwise (re)arms it */
+static void tmff2_update_idle(struct tmff2_device_entry *tmff2, bool expired)
+{
+	if (!idle_msecs || !tmff2->allow_scheduling || !tmff2_wheel_open(tmff2))
+		return;
+
+	if (expired) {
+		tmff2_sleep(tmff2);
+		return;
+	}
+
+	tmff2_power_get(tmff2);
+	mod_delayed_work(system_wq, &tmff2->idle_work,
+			msecs_to_jiffies(idle_msecs));
+}
+
+/* order in which the work handler goes through effect slots, highest first */
+#define TMFF2_RANKS	(2 * TMFF2_CLIENT_PRIORITIES)
+
+static int tmff2_slot_rank(struct tmff2_device_entry *tmff2, int effect_id)
+{
+	return 2 * tmff2_client_priority(tmff2, effect_id) +
+		test_bit(FF_EFFECT_CONSTANT, &tmff2->states[effect_id].flags);
+}
+
+/* one effect slot of the work handler, returns true if the slot needs another
+ * tick. sent is set if anything was sent to the wheel. */
+static bool tmff2_work_slot(struct tmff2_device_entry *tmff2, int effect_id,
+		bool *sent)
+{
+	struct tmff2_effect_state *state = &tmff2->states[effect_id];
+	struct tmff2_effect_payload *payload = &tmff2->payloads[effect_id];
+	struct tmff2_effect_timing timing;
+	unsigned long actions;
+	bool was_playing, playing, reschedule;
+	int failed;
+
+	/* requests over the owner's budget stay set and coalesce with whatever
+	 * comes in until the next tick */
+	if (tmff2_client_throttled(tmff2, effect_id, READ_ONCE(state->flags)))
+		return true;
+
+	was_playing = test_bit(FF_EFFECT_PLAYING, &state->flags);
+	actions = tmff2_sched_take(&state->flags);
+	tmff2_read_timing(state, &timing);
+
+	playing = tmff2_sched_advance(&state->flags, &actions, &timing,
+			JIFFIES2MS(jiffies));
+	reschedule = playing;
+
+	/* the payload is only touched when something changed */
+	if (actions || playing != was_playing)
+		tmff2_track_slot(payload, actions, was_playing, playing);
+
+	if (!test_bit(FF_EFFECT_RESYNC, &state->flags)) {
+		/* nothing to do for this slot, so nothing to wait for either */
+		if (!actions)
+			return reschedule;
+
+		tmff2_fault_begin(tmff2);
+		failed = tmff2_run_actions(tmff2, effect_id, &timing, actions);
+	} else {
+		/* out of sync, whatever was requested in the meantime is
+		 * covered by the resync. A slot raw commands went to has no
+		 * retries pending and waits for its next request. */
+		if (!actions && !tmff2_retry_due(payload->retries,
+					payload->retry_at))
+			return reschedule || (payload->retries &&
+					payload->retries <= TMFF2_MAX_RETRIES);
+
+		/* a new request gets a fresh set of attempts */
+		if (actions)
+			payload->retries = 0;
+
+		tmff2_fault_begin(tmff2);
+		failed = tmff2_resync_slot(tmff2, effect_id, &timing, actions);
+	}
+	tmff2_fault_end(tmff2, &payload->diverged, failed);
+	tmff2_client_charge(tmff2, effect_id, actions);
+
+	if (!failed) {
+		payload->retries = 0;
+		clear_bit(FF_EFFECT_RESYNC, &state->flags);
+	} else {
+		set_bit(FF_EFFECT_RESYNC, &state->flags);
+		if (tmff2_retry_later(tmff2, &payload->retries,
+					&payload->retry_at, "effect", effect_id))
+			reschedule = true;
+	}
+
+	/* wait for each effect update to actually be sent out to avoid
+	 * filling up usb output queue */
+	hid_hw_wait(tmff2->hdev);
+	*sent = true;
+
+	return reschedule;
+}
+
+/* torque streaming, runs on every tick while the mailbox is mapped. The
+ * constant force is started on the first tick and again after a resync, from
+ * then on only its level is sent, and only when userspace stored a new one.
+ * Returns true while the handler has to keep ticking. */
+static bool tmff2_stream_tick(struct tmff2_device_entry *tmff2, bool *sent)
+{
+	struct tmff2_stream *stream = &tmff2->stream;
+	struct tmff2_effect_params params;
+	struct ff_effect effect = {
+		.type = FF_CONSTANT,
+		.direction = 0x4000,
+	};
+	s16 level;
+	u32 seq;
+	int ret;
+
+	clear_bit(TMFF2_PENDING_STREAM, &tmff2->pending);
+	if (stream->slot < 0)
+		return false;
+
+	/* a closed wheel has dropped its effects already */
+	if (!tmff2_wheel_open(tmff2)) {
+		stream->loaded = false;
+		return false;
+	}
+
+	if (!tmff2_cdev_stream(tmff2, &level, &seq)) {
+		if (stream->loaded) {
+			tmff2_stop_effect(tmff2, stream->slot);
+			hid_hw_wait(tmff2->hdev);
+			stream->loaded = false;
+			*sent = true;
+		}
+		return false;
+	}
+
+	if (!stream->loaded) {
+		effect.id = stream->slot;
+		effect.u.constant.level = level;
+
+		ret = tmff2_normalise_effect(tmff2, &effect, &params);
+		if (!ret) {
+			ret = tmff2_upload_effect(tmff2, stream->slot, &params);
+			hid_hw_wait(tmff2->hdev);
+		}
+
+		if (!ret) {
+			ret = tmff2_play_effect(tmff2, stream->slot, 1);
+			hid_hw_wait(tmff2->hdev);
+		}
+
+		*sent = true;
+		if (ret) {
+			stream->failed++;
+			return true;
+		}
+
+		stream->loaded = true;
+		stream->started++;
+	} else if (seq != stream->seq) {
+		ret = tmff2->send_level(tmff2->data, stream->slot, level);
+		hid_hw_wait(tmff2->hdev);
+
+		*sent = true;
+		if (ret) {
+			stream->failed++;
+			return true;
+		}
+
+		stream->missed += seq - stream->seq - 1;
+	} else {
+		return true;
 	}
 
-	if (tmff2->set_autocenter(tmff2->data, value))
-		hid_warn(tmff2->hdev, "unable to set autocenter\n");
+	stream->samples++;
+	stream->seq = seq;
+	tmff2_cdev_stream_ack(tmff2, seq);
+	return true;
 }
 
 static void tmff2_work_handler(struct work_struct *w)
 {
-	unsigned long lock_flags = 0;
 	struct delayed_work *dw = container_of(w, struct delayed_work, work);
 	struct tmff2_device_entry *tmff2 = container_of(dw, struct tmff2_device_entry, work);
-	struct tmff2_effect_state *state;
-	int max_count = 0, effect_id;
-	unsigned long time_now;
-	__u16 effect_delay, effect_length;
+	int reschedule = 0, effect_id, frame, rank, raw_rank = -1;
+	unsigned long ranks = 0;
+	bool idle_check, woke = false, sent = false;
 
 
 	if (!tmff2)
 		return;
 
-	for (effect_id = 0; effect_id < tmff2->max_effects; ++effect_id) {
-		unsigned long actions = 0;
-		struct tmff2_effect_state effect;
+	frame = tmff2_frame_number(tmff2);
+	idle_check = test_and_clear_bit(TMFF2_PENDING_IDLE, &tmff2->pending);
+
+	if (tmff2->power.idle) {
+		if (!tmff2_requested(tmff2))
+			return;
+
+		tmff2_wake(tmff2);
+		woke = true;
+	}
 
-		time_now = JIFFIES2MS(jiffies);
+	if (test_and_clear_bit(TMFF2_PENDING_RESYNC, &tmff2->pending)) {
+		if (tmff2_wheel_open(tmff2))
+			tmff2_resend_open(tmff2);
 
-		state = &tmff2->states[effect_id];
+		tmff2_forget_shadow(tmff2);
+	}
 
-		/* critical section for updating state flags, keep log of what
-		 * actions to take after the critical section with actions */
-		spin_lock_irqsave(&tmff2->lock, lock_flags);
+	if (tmff2_send_commands(tmff2))
+		reschedule = 1;
 
-		effect_delay = state->effect.replay.delay;
-		effect_length = state->effect.replay.length;
-		if (test_bit(FF_EFFECT_PLAYING, &state->flags) && effect_length) {
-			if ((time_now - state->start_time) >=
-					(effect_delay + effect_length) * state->count) {
-				__clear_bit(FF_EFFECT_PLAYING, &state->flags);
-				__clear_bit(FF_EFFECT_QUEUE_UPDATE, &state->flags);
+	/* streamed torque is sampled once per tick, ahead of any effect */
+	if (tmff2_stream_tick(tmff2, &sent))
+		reschedule = 1;
 
-				state->count = 0;
+	/* higher priority clients go first. Within a priority constant forces
+	 * do, they're what games update every frame and what is felt the most,
+	 * so they shouldn't queue up behind the rest. Uploads and rule writes
+	 * may change a slot's rank meanwhile, so it's only taken once per tick
+	 * and no slot is skipped. */
+	for (effect_id = 0; effect_id < tmff2->max_effects; ++effect_id) {
+		tmff2->states[effect_id].rank = tmff2_slot_rank(tmff2, effect_id);
+		__set_bit(tmff2->states[effect_id].rank, &ranks);
+	}
+
+	/* raw commands from the character device queue up behind the driver's
+	 * own effects of the same priority */
+	clear_bit(TMFF2_PENDING_RAW, &tmff2->pending);
+	if (tmff2->cdev)
+		raw_rank = 2 * tmff2_cdev_priority(tmff2);
+
+	for (rank = TMFF2_RANKS - 1; rank >= 0; --rank) {
+		if (test_bit(rank, &ranks)) {
+			for (effect_id = 0; effect_id < tmff2->max_effects;
+					++effect_id) {
+				if (tmff2->states[effect_id].rank != rank)
+					continue;
+
+				if (tmff2_work_slot(tmff2, effect_id, &sent))
+					reschedule = 1;
 			}
 		}
 
-		if (test_bit(FF_EFFECT_QUEUE_UPLOAD, &state->flags)) {
-			__set_bit(FF_EFFECT_QUEUE_UPLOAD, &actions);
-			__clear_bit(FF_EFFECT_QUEUE_UPLOAD, &state->flags);
-			/* if we're uploading an effect, it's bound to be up
-			 * to date */
-			__clear_bit(FF_EFFECT_QUEUE_UPDATE, &state->flags);
+		if (rank == raw_rank && tmff2_cdev_dispatch(tmff2, &sent))
+			reschedule = 1;
+	}
+
+	/* commands lost in a packed report may belong to any slot */
+	if (tmff2_flush_commands(tmff2)) {
+		set_bit(TMFF2_PENDING_RESYNC, &tmff2->pending);
+		reschedule = 1;
+	}
+
+	if (sent)
+		tmff2_account_frames(tmff2, frame);
+
+	if (woke)
+		tmff2_account_wake(tmff2);
+
+	if (unlikely(tmff2->power.resuming)) {
+		tmff2->power.resume_ns = ktime_to_ns(ktime_sub(ktime_get(),
+					tmff2->power.resumed_at));
+		tmff2->power.resuming = false;
+	}
+
+	if (!reschedule)
+		tmff2_update_idle(tmff2, idle_check && !sent && !woke);
+	else if (tmff2->allow_scheduling)
+		schedule_delayed_work(&tmff2->work, tmff2_tick(tmff2));
+}
+
+/* the idle timer ran out, have the work handler check whether the wheel can be
+ * closed */
+static void tmff2_idle_handler(struct work_struct *w)
+{
+	struct delayed_work *dw = container_of(w, struct delayed_work, work);
+	struct tmff2_device_entry *tmff2 = container_of(dw, struct tmff2_device_entry, idle_work);
+
+	set_bit(TMFF2_PENDING_IDLE, &tmff2->pending);
+	if (tmff2->allow_scheduling)
+		schedule_delayed_work(&tmff2->work, 0);
+}
+
+/* make sure the work handler picks up freshly queued requests */
+static void tmff2_kick(struct tmff2_device_entry *tmff2, unsigned long delay)
+{
+	/* an idle wheel has to be opened first, don't wait a tick on top */
+	if (unlikely(READ_ONCE(tmff2->power.idle))) {
+		if (!tmff2->power.wake_request)
+			tmff2->power.wake_request = ktime_get();
+		delay = 0;
+	}
+
+	if (!delayed_work_pending(&tmff2->work) && tmff2->allow_scheduling)
+		schedule_delayed_work(&tmff2->work, delay);
+}
+
+/* have the work handler send the whole settings block */
+static void tmff2_queue_settings(struct tmff2_device_entry *tmff2)
+{
+	smp_mb__before_atomic();
+	set_bit(TMFF2_PENDING_SETTINGS, &tmff2->pending);
+	tmff2_kick(tmff2, 0);
+}
+
+/* have the work handler bring everything on the wheel back in line */
+static void tmff2_queue_resync(struct tmff2_device_entry *tmff2)
+{
+	smp_mb__before_atomic();
+	set_bit(TMFF2_PENDING_RESYNC, &tmff2->pending);
+	tmff2_kick(tmff2, 0);
+}
+
+/* called by the character device with its lock held */
+void tmff2_queue_raw(struct tmff2_device_entry *tmff2)
+{
+	smp_mb__before_atomic();
+	set_bit(TMFF2_PENDING_RAW, &tmff2->pending);
+	tmff2_kick(tmff2, 0);
+}
+
+/* the torque stream mailbox was mapped or unmapped, called by the character
+ * device with its lock held */
+void tmff2_queue_stream(struct tmff2_device_entry *tmff2)
+{
+	smp_mb__before_atomic();
+	set_bit(TMFF2_PENDING_STREAM, &tmff2->pending);
+	tmff2_kick(tmff2, 0);
+}
+
+/* the value itself has already been stored by the caller, the work handler
+ * picks it up on its next tick */
+static void tmff2_queue_command(struct tmff2_device_entry *tmff2,
+		enum tmff2_command command)
+{
+	atomic_long_inc(&tmff2->commands[command].requested);
+
+	smp_mb__before_atomic();
+	set_bit(command, &tmff2->pending);
+	tmff2_kick(tmff2, tmff2_tick(tmff2));
+}
+
+static void tmff2_rewrite_rumble(struct ff_effect *effect)
+{
+	/* this is more or less directly copied from
+	 * https://elixir.bootlin.com/linux/latest/source/drivers/input/ff-core.c#L48
+	 * except we set the direction to east, to make sure the direction
+	 * scaling doesn't do any funny business */
+	int magnitude = 0;
+	if (effect->type != FF_RUMBLE)
+		return;
+
+	magnitude = effect->u.rumble.strong_magnitude / 3
+		+ effect->u.rumble.weak_magnitude / 6;
+
+	effect->type = FF_PERIODIC;
+	effect->direction = 16384;
+	effect->u.periodic.waveform = FF_SINE;
+	effect->u.periodic.period = 50;
+	effect->u.periodic.magnitude = magnitude;
+	effect->u.periodic.offset = 0;
+	effect->u.periodic.phase = 0;
+	effect->u.periodic.envelope.attack_length = 0;
+	effect->u.periodic.envelope.attack_level = 0;
+	effect->u.periodic.envelope.fade_length = 0;
+	effect->u.periodic.envelope.fade_level = 0;
+}
+
+/* rewrite rumble and bring the effect into the device format. It's just
+ * maths and doesn't sleep, batches do it under the input core's event_lock */
+static int tmff2_prepare_effect(struct tmff2_device_entry *tmff2,
+		const struct ff_effect *effect, struct tmff2_effect_params *params)
+{
+	struct ff_effect rewritten = *effect;
+
+	tmff2_rewrite_rumble(&rewritten);
+	return tmff2_normalise_effect(tmff2, &rewritten, params);
+}
+
+/* hand a prepared effect to the work handler */
+static void tmff2_store_effect(struct tmff2_device_entry *tmff2,
+		const struct ff_effect *effect,
+		const struct tmff2_effect_params *params, bool update)
+{
+	struct tmff2_effect_state *state = &tmff2->states[effect->id];
+	struct tmff2_effect_timing timing;
+	unsigned long irqflags;
+
+	tmff2_client_upload(tmff2, effect->id);
+
+	tmff2_publish_params(&tmff2->payloads[effect->id], params);
+
+	/* writers always leave both copies identical, so under the lock either
+	 * one is the current value */
+	spin_lock_irqsave(&state->lock, irqflags);
+	timing = state->timing[0];
+	timing.delay = effect->replay.delay;
+	timing.length = effect->replay.length;
+	tmff2_publish_timing(state, &timing);
+	spin_unlock_irqrestore(&state->lock, irqflags);
+
+	if (effect->type == FF_CONSTANT)
+		set_bit(FF_EFFECT_CONSTANT, &state->flags);
+	else
+		clear_bit(FF_EFFECT_CONSTANT, &state->flags);
+
+	tmff2_sched_request_upload(&state->flags, update);
+}
+
+static void tmff2_store_play(struct tmff2_device_entry *tmff2, int effect_id,
+		int value)
+{
+	struct tmff2_effect_state *state = &tmff2->states[effect_id];
+	struct tmff2_effect_timing timing;
+
+	tmff2_client_play(tmff2, effect_id);
+
+	/* called with the input core's event_lock held, interrupts are off */
+	if (value > 0) {
+		spin_lock(&state->lock);
+		timing = state->timing[0];
+		timing.count = value;
+		timing.start_time = JIFFIES2MS(jiffies);
+		tmff2_publish_timing(state, &timing);
+		spin_unlock(&state->lock);
+	}
+
+	tmff2_sched_request_play(&state->flags, value);
+}
+
+static int tmff2_check_effect(struct tmff2_device_entry *tmff2,
+		const struct ff_effect *effect, struct tmff2_effect_params *params)
+{
+	if (effect->type == FF_PERIODIC && effect->u.periodic.period == 0)
+		return -EINVAL;
+
+	return tmff2_prepare_effect(tmff2, effect, params);
+}
+
+static int tmff2_upload(struct input_dev *dev,
+		struct ff_effect *effect, struct ff_effect *old)
+{
+	struct tmff2_effect_params params;
+	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+	int ret;
+
+	if (!tmff2)
+		return -ENODEV;
+
+	/* record what ff-core handed us, even if we end up rejecting it */
+	if (unlikely(tmff2->tracing))
+		tmff2_trace_upload(tmff2, effect, old);
+
+	if ((ret = tmff2_check_effect(tmff2, effect, &params)))
+		return ret;
+
+	tmff2_store_effect(tmff2, effect, &params, old != NULL);
+
+	/* updates to a playing effect are picked up by the next tick anyway,
+	 * don't go faster than the timer */
+	tmff2_kick(tmff2, tmff2_tick(tmff2));
+	return 0;
+}
+
+static int tmff2_play(struct input_dev *dev, int effect_id, int value)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+
+	if (!tmff2)
+		return -ENODEV;
+
+	if (unlikely(tmff2->tracing))
+		tmff2_trace_event(tmff2, TMFF2_TRACE_PLAY, effect_id, value);
+
+	tmff2_store_play(tmff2, effect_id, value);
+
+	tmff2_kick(tmff2, 0);
+	return 0;
+}
+
+/* ff-core has already stopped the effect when this runs */
+static int tmff2_erase(struct input_dev *dev, int effect_id)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+
+	if (tmff2)
+		tmff2_client_erase(tmff2, effect_id);
+
+	return 0;
+}
+
+/* TMFF2_IOC_BATCH on the character device. Everything is applied under a
+ * single acquisition of the locks ff-core takes for each upload and play,
+ * and the work handler is kicked once. Only effects the calling process
+ * uploaded through evdev can be touched, and nothing is applied unless every
+ * entry checks out. ff-core's own copy of updated effects is kept current, as
+ * it would be after EVIOCSFF. */
+int tmff2_batch(struct tmff2_device_entry *tmff2,
+		const struct tmff2_batch_entry *entries, unsigned int count)
+{
+	struct input_dev *dev = tmff2->input_dev;
+	struct ff_device *ff = dev->ff;
+	const struct tmff2_batch_entry *entry;
+	struct tmff2_effect_params *params;
+	struct ff_effect *effects;
+	unsigned long delay;
+	unsigned int i;
+	int ret = 0, id;
+
+	params = kcalloc(count, sizeof(*params), GFP_KERNEL);
+	effects = kcalloc(count, sizeof(*effects), GFP_KERNEL);
+	if (!params || !effects) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&ff->mutex);
+	spin_lock_irq(&dev->event_lock);
+
+	for (i = 0; i < count; ++i) {
+		entry = &entries[i];
+		id = entry->effect.id;
+
+		if (!entry->flags || (entry->flags & ~TMFF2_BATCH_FLAGS) ||
+				id < 0 || id >= tmff2->max_effects ||
+				!ff->effect_owners[id]) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+
+		if (!tmff2_client_owns(tmff2, id)) {
+			ret = -EPERM;
+			goto unlock;
 		}
 
-		if (test_bit(FF_EFFECT_QUEUE_UPDATE, &state->flags)) {
-			__set_bit(FF_EFFECT_QUEUE_UPDATE, &actions);
-			__clear_bit(FF_EFFECT_QUEUE_UPDATE, &state->flags);
+		if (!(entry->flags & TMFF2_BATCH_UPDATE))
+			continue;
+
+		tmff2_trace_to_effect(&entry->effect, &effects[i]);
+		if (effects[i].type != ff->effects[id].type) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+
+		/* as input_ff_upload checks it */
+		if (effects[i].type == FF_PERIODIC &&
+				(effects[i].u.periodic.waveform < FF_WAVEFORM_MIN ||
+				 effects[i].u.periodic.waveform > FF_WAVEFORM_MAX ||
+				 !test_bit(effects[i].u.periodic.waveform,
+					 dev->ffbit))) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+
+		if ((ret = tmff2_check_effect(tmff2, &effects[i], &params[i])))
+			goto unlock;
+	}
+
+	delay = tmff2_tick(tmff2);
+	for (i = 0; i < count; ++i) {
+		entry = &entries[i];
+		id = entry->effect.id;
+
+		if (entry->flags & TMFF2_BATCH_UPDATE) {
+			if (unlikely(tmff2->tracing))
+				tmff2_trace_upload(tmff2, &effects[i], true);
+
+			tmff2_store_effect(tmff2, &effects[i], &params[i], true);
+			ff->effects[id] = effects[i];
 		}
 
-		if (test_bit(FF_EFFECT_QUEUE_START, &state->flags)) {
-			__set_bit(FF_EFFECT_QUEUE_START, &actions);
-			__clear_bit(FF_EFFECT_QUEUE_START, &state->flags);
-			/* effect is playing since we're started it right now */
-			__set_bit(FF_EFFECT_PLAYING, &state->flags);
+		if (entry->flags & TMFF2_BATCH_PLAY) {
+			if (unlikely(tmff2->tracing))
+				tmff2_trace_event(tmff2, TMFF2_TRACE_PLAY, id,
+						entry->value);
+
+			tmff2_store_play(tmff2, id, entry->value);
+			delay = 0;
 		}
+	}
+
+	tmff2_kick(tmff2, delay);
+
+unlock:
+	spin_unlock_irq(&dev->event_lock);
+	mutex_unlock(&ff->mutex);
+out:
+	kfree(effects);
+	kfree(params);
+	return ret;
+}
+
+static int tmff2_open(struct input_dev *dev)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+	int ret;
+
+	if (!tmff2)
+		return -ENODEV;
+
+	if (!tmff2->open) {
+		hid_err(tmff2->hdev, "no open callback set\n");
+		return -EINVAL;
+	}
+
+	if ((ret = tmff2->open(tmff2->data, open_mode)))
+		return ret;
+
+	tmff2->opened = true;
+
+	/* the mode change on open may have reset the wheel */
+	if (open_mode) {
+		WRITE_ONCE(tmff2->power.idle, false);
+		tmff2_queue_settings(tmff2);
+	}
+
+	/* start the idle timer */
+	if (idle_msecs)
+		tmff2_kick(tmff2, 0);
+
+	return 0;
+}
+
+static void tmff2_close(struct input_dev *dev)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+
+	if (!tmff2)
+		return;
+
+	/* since we're closing the device, no need to continue feeding it new data */
+	/* TODO: check somewhere that multiple users can't open us at the same
+	 * time */
+	cancel_delayed_work_sync(&tmff2->idle_work);
+	cancel_delayed_work_sync(&tmff2->work);
+	tmff2->opened = false;
+	tmff2_power_put(tmff2);
+
+	/* closing sends the close command, so nothing to wake up from.
+	 * Otherwise the wheel stays closed until it's needed again. */
+	if (open_mode)
+		WRITE_ONCE(tmff2->power.idle, false);
+
+	if (tmff2->close) {
+		tmff2->close(tmff2->data, open_mode);
+		return;
+	}
 
-		if (test_bit(FF_EFFECT_QUEUE_STOP, &state->flags)) {
-			__set_bit(FF_EFFECT_QUEUE_STOP, &actions);
-			__clear_bit(FF_EFFECT_QUEUE_STOP, &state->flags);
+	hid_err(tmff2->hdev, "no close callback set\n");
+}
 
-			/* the effect can't be playing if we're stopped, aye? */
-			__clear_bit(FF_EFFECT_PLAYING, &state->flags);
-		}
+static struct tmff2_profile *tmff2_find_profile(struct hid_device *hdev)
+{
+	struct tmff2_profile *profile;
 
-		if (state->count > max_count)
-			max_count = state->count;
+	lockdep_assert_held(&tmff2_profiles_lock);
 
-		/* copy effect state to local variable so we can pass it around
-		 * after the atomic section */
-		effect = *state;
+	list_for_each_entry(profile, &tmff2_profiles, list) {
+		if (profile->vendor == hdev->vendor
+				&& profile->product == hdev->product
+				&& !strncmp(profile->uniq, hdev->uniq,
+					sizeof(profile->uniq)))
+			return profile;
+	}
 
-		spin_unlock_irqrestore(&tmff2->lock, lock_flags);
+	return NULL;
+}
 
-		/* perform the identified actions */
-		if (test_bit(FF_EFFECT_QUEUE_UPLOAD, &actions)
-				&& tmff2->upload_effect(tmff2->data, &effect)) {
-			hid_warn(tmff2->hdev, "failed uploading effect\n");
+static void tmff2_store_profile(struct tmff2_device_entry *tmff2,
+		const struct tmff2_settings *settings)
+{
+	struct hid_device *hdev = tmff2->hdev;
+	struct tmff2_profile *profile;
+
+	mutex_lock(&tmff2_profiles_lock);
+
+	if (!(profile = tmff2_find_profile(hdev))) {
+		if (tmff2_nr_profiles >= TMFF2_MAX_PROFILES) {
+			/* recycle the least recently written one */
+			profile = list_last_entry(&tmff2_profiles,
+					struct tmff2_profile, list);
+		} else if ((profile = kzalloc(sizeof(*profile), GFP_KERNEL))) {
+			list_add(&profile->list, &tmff2_profiles);
+			tmff2_nr_profiles++;
+		} else {
+			hid_warn(hdev, "could not cache profile\n");
+			goto out;
 		}
 
-		if (test_bit(FF_EFFECT_QUEUE_UPDATE, &actions)
-				&& tmff2->update_effect(tmff2->data, &effect)) {
-			hid_warn(tmff2->hdev, "failed updating effect\n");
-		}
+		profile->vendor = hdev->vendor;
+		profile->product = hdev->product;
+		strscpy(profile->uniq, hdev->uniq, sizeof(profile->uniq));
+	}
 
-		if (test_bit(FF_EFFECT_QUEUE_START, &actions)
-				&& tmff2->play_effect(tmff2->data, &effect)) {
-			hid_warn(tmff2->hdev, "failed starting effect\n");
-		}
+	profile->settings = *settings;
+	list_move(&profile->list, &tmff2_profiles);
+out:
+	mutex_unlock(&tmff2_profiles_lock);
+}
 
-		if (test_bit(FF_EFFECT_QUEUE_STOP, &actions)
-				&& tmff2->stop_effect(tmff2->data, &effect)) {
-			hid_warn(tmff2->hdev, "failed stopping effect\n");
-		}
+/* restore a cached profile, if there is one, before anything is sent */
+static void tmff2_restore_profile(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_profile *profile;
 
+	mutex_lock(&tmff2_profiles_lock);
 
-		/* wait for each effect update to actually be sent out to avoid
-		 * filling up usb output queue */
-		hid_hw_wait(tmff2->hdev);
+	if ((profile = tmff2_find_profile(tmff2->hdev))) {
+		tmff2->settings = profile->settings;
+		hid_info(tmff2->hdev, "restored cached profile\n");
 	}
 
-	if (max_count && tmff2->allow_scheduling)
-		schedule_delayed_work(&tmff2->work, msecs_to_jiffies(timer_msecs));
+	mutex_unlock(&tmff2_profiles_lock);
 }
 
-static void tmff2_rewrite_rumble(struct ff_effect *effect)
+static void tmff2_free_profiles(void)
 {
-	/* this is more or less directly copied from
-	 * https://elixir.bootlin.com/linux/latest/source/drivers/input/ff-core.c#L48
-	 * except we set the direction to east, to make sure the direction
-	 * scaling doesn't do any funny business */
-	int magnitude = 0;
-	if (effect->type != FF_RUMBLE)
-		return;
+	struct tmff2_profile *profile, *tmp;
 
-	magnitude = effect->u.rumble.strong_magnitude / 3
-		+ effect->u.rumble.weak_magnitude / 6;
+	list_for_each_entry_safe(profile, tmp, &tmff2_profiles, list) {
+		list_del(&profile->list);
+		kfree(profile);
+	}
 
-	effect->type = FF_PERIODIC;
-	effect->direction = 16384;
-	effect->u.periodic.waveform = FF_SINE;
-	effect->u.periodic.period = 50;
-	effect->u.periodic.magnitude = magnitude;
-	effect->u.periodic.offset = 0;
-	effect->u.periodic.phase = 0;
-	effect->u.periodic.envelope.attack_length = 0;
-	effect->u.periodic.envelope.attack_level = 0;
-	effect->u.periodic.envelope.fade_length = 0;
-	effect->u.periodic.envelope.fade_level = 0;
+	tmff2_nr_profiles = 0;
 }
 
-static int tmff2_upload(struct input_dev *dev,
-		struct ff_effect *effect, struct ff_effect *old)
+/* a profile is a complete settings block, written as space separated
+ * key=value pairs, all of which have to be present:
+ *
+ *	range=900 gain=40000 autocenter=0 spring_level=30 damper_level=30 friction_level=30
+ *
+ * autocenter=-1 leaves the wheel's own autocentering alone. The range has to
+ * be within the model's bounds, the ones below are only the widest any model
+ * takes.
+ */
+static const struct {
+	const char *name;
+	size_t offset;
+	int min, max;
+} tmff2_profile_keys[] = {
+	{"range", offsetof(struct tmff2_settings, range), 40, 1080},
+	{"gain", offsetof(struct tmff2_settings, gain), 0, GAIN_MAX},
+	{"autocenter", offsetof(struct tmff2_settings, autocenter), -1, 0xffff},
+	{"spring_level", offsetof(struct tmff2_settings, spring_level), 0, 100},
+	{"damper_level", offsetof(struct tmff2_settings, damper_level), 0, 100},
+	{"friction_level", offsetof(struct tmff2_settings, friction_level), 0, 100},
+};
+
+static int tmff2_parse_profile(struct tmff2_device_entry *tmff2,
+		struct device *dev, char *buf, struct tmff2_settings *settings)
 {
-	unsigned long lock_flags = 0;
-	struct tmff2_effect_state *state;
-	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+	unsigned long seen = 0;
+	char *token, *value;
+	int i, ret, v, min, max;
 
-	if (!tmff2)
-		return -ENODEV;
+	while ((token = strsep(&buf, " \t\n"))) {
+		if (!*token)
+			continue;
 
-	if (effect->type == FF_PERIODIC && effect->u.periodic.period == 0)
-		return -EINVAL;
+		if (!(value = strchr(token, '='))) {
+			dev_err(dev, "malformed profile entry '%s'\n", token);
+			return -EINVAL;
+		}
 
-	state = &tmff2->states[effect->id];
+		*value++ = '\0';
 
-	spin_lock_irqsave(&tmff2->lock, lock_flags);
+		for (i = 0; i < ARRAY_SIZE(tmff2_profile_keys); ++i)
+			if (!strcmp(token, tmff2_profile_keys[i].name))
+				break;
 
-	state->effect = *effect;
-	tmff2_rewrite_rumble(&state->effect);
+		if (i == ARRAY_SIZE(tmff2_profile_keys)) {
+			dev_err(dev, "unknown profile key '%s'\n", token);
+			return -EINVAL;
+		}
+
+		if ((ret = kstrtoint(value, 0, &v)))
+			return ret;
 
-	if (old) {
-		if (!test_bit(FF_EFFECT_QUEUE_UPDATE, &state->flags)) {
-			state->old = *old;
-			tmff2_rewrite_rumble(&state->old);
+		min = tmff2_profile_keys[i].min;
+		max = tmff2_profile_keys[i].max;
+		if (tmff2_profile_keys[i].offset ==
+				offsetof(struct tmff2_settings, range)) {
+			min = max_t(int, min, tmff2->range_min);
+			max = min_t(int, max, tmff2->range_max);
 		}
 
-		__set_bit(FF_EFFECT_QUEUE_UPDATE, &state->flags);
-	} else {
-		__set_bit(FF_EFFECT_QUEUE_UPLOAD, &state->flags);
+		if (v < min || v > max) {
+			dev_err(dev, "%s=%i out of range [%i, %i]\n", token, v,
+					min, max);
+			return -ERANGE;
+		}
+
+		*(int *)((char *)settings + tmff2_profile_keys[i].offset) = v;
+		__set_bit(i, &seen);
+	}
+
+	if (seen != BIT(ARRAY_SIZE(tmff2_profile_keys)) - 1) {
+		dev_err(dev, "incomplete profile\n");
+		return -EINVAL;
 	}
 
-	spin_unlock_irqrestore(&tmff2->lock, lock_flags);
 	return 0;
 }
 
-static int tmff2_play(struct input_dev *dev, int effect_id, int value)
+static ssize_t profile_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	unsigned long lock_flags = 0;
-	struct tmff2_effect_state *state;
-	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	struct tmff2_settings settings;
+	unsigned long flags;
+	char *copy;
+	int ret;
 
 	if (!tmff2)
 		return -ENODEV;
 
-	state = &tmff2->states[effect_id];
-	if (!state)
-		return 0;
+	if (!(copy = kstrndup(buf, count, GFP_KERNEL)))
+		return -ENOMEM;
 
-	spin_lock_irqsave(&tmff2->lock, lock_flags);
-	if (value > 0) {
-		state->count = value;
-		state->start_time = JIFFIES2MS(jiffies);
-		__set_bit(FF_EFFECT_QUEUE_START, &state->flags);
-		__clear_bit(FF_EFFECT_QUEUE_STOP, &state->flags);
-	} else {
-		__set_bit(FF_EFFECT_QUEUE_STOP, &state->flags);
-		__clear_bit(FF_EFFECT_QUEUE_START, &state->flags);
-	}
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	settings = tmff2->settings;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
 
-	spin_unlock_irqrestore(&tmff2->lock, lock_flags);
+	ret = tmff2_parse_profile(tmff2, dev, copy, &settings);
+	kfree(copy);
+	if (ret)
+		return ret;
 
-	if (!delayed_work_pending(&tmff2->work) && tmff2->allow_scheduling)
-		schedule_delayed_work(&tmff2->work, 0);
+	spin_lock_irqsave(&tmff2->settings_lock, flags);
+	tmff2->settings = settings;
+	spin_unlock_irqrestore(&tmff2->settings_lock, flags);
 
-	return 0;
+	tmff2_store_profile(tmff2, &settings);
+	tmff2_queue_settings(tmff2);
+	return count;
 }
 
-static int tmff2_open(struct input_dev *dev)
+static ssize_t profile_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(to_hid_device(dev));
+	struct tmff2_settings *settings;
 
 	if (!tmff2)
 		return -ENODEV;
 
-	if (tmff2->open)
-		return tmff2->open(tmff2->data, open_mode);
-
-	hid_err(tmff2->hdev, "no open callback set\n");
-	return -EINVAL;
-}
-
-static void tmff2_close(struct input_dev *dev)
-{
-	struct tmff2_device_entry *tmff2 = tmff2_from_input(dev);
-
-	if (!tmff2)
-		return;
-
-	/* since we're closing the device, no need to continue feeding it new data */
-	/* TODO: check somewhere that multiple users can't open us at the same
-	 * time */
-	cancel_delayed_work_sync(&tmff2->work);
-
-	if (tmff2->close) {
-		tmff2->close(tmff2->data, open_mode);
-		return;
-	}
-
-	hid_err(tmff2->hdev, "no close callback set\n");
+	settings = &tmff2->settings;
+	return scnprintf(buf, PAGE_SIZE,
+			"range=%i gain=%i autocenter=%i spring_level=%i damper_level=%i friction_level=%i\n",
+			settings->range, settings->gain, settings->autocenter,
+			settings->spring_level, settings->damper_level,
+			settings->friction_level);
 }
+static DEVICE_ATTR_RW(profile);
 
 static int tmff2_create_files(struct tmff2_device_entry *tmff2)
 {
@@ -569,8 +1819,15 @@ static int tmff2_create_files(struct tmff2_device_entry *tmff2)
 		}
 	}
 
+	if ((ret = device_create_file(dev, &dev_attr_profile))) {
+		hid_warn(tmff2->hdev, "unable to create sysfs for profile\n");
+		goto profile_err;
+	}
+
 	return 0;
 
+profile_err:
+	device_remove_file(dev, &dev_attr_friction_level);
 friction_err:
 	device_remove_file(dev, &dev_attr_damper_level);
 damper_err:
@@ -585,28 +1842,277 @@ gain_err:
 	return ret;
 }
 
+void tmff2_boot_mark(struct tmff2_device_entry *tmff2,
+		enum tmff2_boot_phase phase, ktime_t start, ktime_t end)
+{
+	tmff2->boot.phase_ns[phase] = ktime_to_ns(ktime_sub(end, start));
+	__set_bit(phase, &tmff2->boot.seen);
+}
+
+static const char *const tmff2_boot_phase_names[TMFF2_BOOT_PHASES] = {
+	[TMFF2_BOOT_PARSE]	= "parse",
+	[TMFF2_BOOT_HW_START]	= "hw_start",
+	[TMFF2_BOOT_WHEEL_INIT]	= "wheel_init",
+	[TMFF2_BOOT_FIRMWARE]	= "firmware",
+	[TMFF2_BOOT_ATTACHMENT]	= "attachment",
+	[TMFF2_BOOT_SETUP]	= "setup",
+	[TMFF2_BOOT_FF_CREATE]	= "ff_create",
+	[TMFF2_BOOT_SYSFS]	= "sysfs",
+};
+
+static int tmff2_boot_timeline_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_boot_timeline *boot = &tmff2->boot;
+	int i;
+
+	/* absolute probe time, to line up with udev and dmesg timestamps */
+	seq_printf(m, "%-12s %lld us\n", "probe", ktime_to_us(boot->probe));
+
+	for (i = 0; i < TMFF2_BOOT_PHASES; ++i) {
+		if (!test_bit(i, &boot->seen))
+			continue;
+
+		seq_printf(m, "%-12s %lld us\n", tmff2_boot_phase_names[i],
+				div_s64(boot->phase_ns[i], NSEC_PER_USEC));
+	}
+
+	seq_printf(m, "%-12s %lld us\n", "total",
+			ktime_us_delta(boot->ready, boot->probe));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_boot_timeline);
+
+static const char *const tmff2_command_names[TMFF2_CMDS] = {
+	[TMFF2_CMD_RANGE]	= "range",
+	[TMFF2_CMD_GAIN]	= "gain",
+	[TMFF2_CMD_AUTOCENTER]	= "autocenter",
+};
+
+static int tmff2_commands_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_command_state *state;
+	int i;
+
+	seq_printf(m, "%-12s %10s %10s %10s %8s %8s\n",
+			"command", "requested", "sent", "unchanged", "value",
+			"retries");
+
+	for (i = 0; i < TMFF2_CMDS; ++i) {
+		state = &tmff2->commands[i];
+		seq_printf(m, "%-12s %10ld %10lu %10lu %8i %8u\n",
+				tmff2_command_names[i],
+				atomic_long_read(&state->requested),
+				state->nr_sent, state->nr_unchanged,
+				state->sent, state->retries);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_commands);
+
+/* what the wheel is believed to hold against what it should hold, L for a
+ * loaded effect, P for a playing one and R for a slot raw commands went to.
+ * Read without locking, so entries may
+ * be slightly torn while the work handler runs. */
+static int tmff2_shadow_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_effect_payload *payload;
+	int i;
+
+	seq_printf(m, "open: %i\n", tmff2->opened);
+	seq_printf(m, "%4s %6s %6s %8s\n", "slot", "held", "wanted", "retries");
+
+	for (i = 0; i < tmff2->max_effects; ++i) {
+		payload = &tmff2->payloads[i];
+		if (!payload->held && !payload->wanted && !payload->retries)
+			continue;
+
+		seq_printf(m, "%4i %5c%c %5c%c %8u\n", i,
+				test_bit(TMFF2_SLOT_RAW, &payload->held) ? 'R' :
+				test_bit(TMFF2_SLOT_LOADED, &payload->held) ? 'L' : '-',
+				test_bit(TMFF2_SLOT_PLAYING, &payload->held) ? 'P' : '-',
+				test_bit(TMFF2_SLOT_LOADED, &payload->wanted) ? 'L' : '-',
+				test_bit(TMFF2_SLOT_PLAYING, &payload->wanted) ? 'P' : '-',
+				payload->retries);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_shadow);
+
+static int tmff2_frames_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_frames *frames = &tmff2->frames;
+	int i;
+
+	if (!frames->usbdev) {
+		seq_puts(m, "not on USB\n");
+		return 0;
+	}
+
+	seq_printf(m, "interval: %u us\n", frames->interval_us);
+	seq_printf(m, "tick: %u ms\n",
+			jiffies_to_msecs(tmff2_tick(tmff2)));
+	seq_printf(m, "ticks: %lu\n", frames->ticks);
+	seq_printf(m, "%6s %10s %10s\n", "frames", "spanned", "phase");
+
+	for (i = 0; i < TMFF2_FRAME_BUCKETS; ++i)
+		seq_printf(m, "%5i%c %10lu %10lu\n", i,
+				i == TMFF2_FRAME_BUCKETS - 1 ? '+' : ' ',
+				frames->spans[i], frames->phases[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_frames);
+
+/* find the service interval of the interrupt OUT endpoint output reports go
+ * through. bInterval is in frames on full speed and an exponent of
+ * microframes on high speed and up. Without such an endpoint reports go over
+ * the control pipe, which isn't scheduled, so treat that as one frame. */
+static void tmff2_frames_init(struct tmff2_device_entry *tmff2)
+{
+	struct tmff2_frames *frames = &tmff2->frames;
+	struct usb_interface *usbif;
+	struct usb_host_interface *alt;
+	struct usb_endpoint_descriptor *desc;
+	int i;
+
+	frames->interval_us = USEC_PER_MSEC;
+	frames->interval_ms = 1;
+
+	/* uhid devices may claim to be on USB too */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	if (!hid_is_usb(tmff2->hdev))
+		return;
+#else
+	if (tmff2->hdev->bus != BUS_USB)
+		return;
+#endif
+
+	usbif = to_usb_interface(tmff2->hdev->dev.parent);
+	alt = usbif->cur_altsetting;
+	frames->usbdev = interface_to_usbdev(usbif);
+
+	for (i = 0; i < alt->desc.bNumEndpoints; ++i) {
+		desc = &alt->endpoint[i].desc;
+		if (!usb_endpoint_is_int_out(desc))
+			continue;
+
+		if (frames->usbdev->speed >= USB_SPEED_HIGH)
+			frames->interval_us = 125 <<
+				(clamp_t(int, desc->bInterval, 1, 16) - 1);
+		else
+			frames->interval_us = max_t(int, desc->bInterval, 1)
+				* USEC_PER_MSEC;
+		break;
+	}
+
+	frames->interval_ms = max(DIV_ROUND_UP(frames->interval_us,
+				USEC_PER_MSEC), 1U);
+}
+
+static int tmff2_power_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_power *power = &tmff2->power;
+
+	seq_printf(m, "idle: %i\n", power->idle);
+	seq_printf(m, "powered: %i\n", power->powered);
+	seq_printf(m, "idled: %lu\n", power->idled);
+	seq_printf(m, "woken: %lu\n", power->woken);
+
+	if (power->woken)
+		seq_printf(m, "wake avg/max: %lld/%lld us\n",
+				div_s64(div_s64(power->wake_total_ns,
+						power->woken), NSEC_PER_USEC),
+				div_s64(power->wake_max_ns, NSEC_PER_USEC));
+
+	seq_printf(m, "resumed: %lu\n", power->resumed);
+	if (power->resumed)
+		seq_printf(m, "last resume replay: %lld us\n",
+				div_s64(power->resume_ns, NSEC_PER_USEC));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_power);
+
+static int tmff2_stream_show(struct seq_file *m, void *unused)
+{
+	struct tmff2_device_entry *tmff2 = m->private;
+	struct tmff2_stream *stream = &tmff2->stream;
+
+	seq_printf(m, "slot: %i\n", stream->slot);
+	seq_printf(m, "loaded: %i\n", stream->loaded);
+	seq_printf(m, "started: %lu\n", stream->started);
+	seq_printf(m, "samples: %lu\n", stream->samples);
+	seq_printf(m, "missed: %lu\n", stream->missed);
+	seq_printf(m, "failed: %lu\n", stream->failed);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tmff2_stream);
+
+static int tmff2_resync_set(void *data, u64 val)
+{
+	struct tmff2_device_entry *tmff2 = data;
+
+	if (val)
+		tmff2_queue_resync(tmff2);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(tmff2_resync_fops, NULL, tmff2_resync_set, "%llu\n");
+
 static int tmff2_wheel_init(struct tmff2_device_entry *tmff2)
 {
 	int ret, i;
 	struct ff_device *ff;
+	ktime_t start;
 
-	spin_lock_init(&lock);
-	spin_lock_init(&tmff2->lock);
 	INIT_DELAYED_WORK(&tmff2->work, tmff2_work_handler);
+	INIT_DELAYED_WORK(&tmff2->idle_work, tmff2_idle_handler);
 
 	/* get parameters etc from backend */
-	if ((ret = tmff2->wheel_init(tmff2, open_mode)))
+	start = ktime_get();
+	ret = tmff2->wheel_init(tmff2, open_mode);
+	tmff2_boot_mark(tmff2, TMFF2_BOOT_WHEEL_INIT, start, ktime_get());
+	if (ret)
 		goto err;
 
+	/* the last slot on the wheel goes to the torque stream, ff-core only
+	 * gets to see the others */
+	tmff2->stream.slot = -1;
+	if (torque_stream && tmff2->send_level && tmff2->max_effects > 1)
+		tmff2->stream.slot = --tmff2->max_effects;
 
-	tmff2->states = kzalloc(sizeof(struct tmff2_effect_state) * tmff2->max_effects,
-			GFP_KERNEL);
+	/* the state array is scanned on every tick, keep it separate from the
+	 * (much larger) effect parameters */
+	tmff2->states = kcalloc(tmff2->max_effects,
+			sizeof(struct tmff2_effect_state), GFP_KERNEL);
 
 	if (!tmff2->states) {
 		ret = -ENOMEM;
 		goto err;
 	}
 
+	tmff2->payloads = kcalloc(tmff2->max_effects,
+			sizeof(struct tmff2_effect_payload), GFP_KERNEL);
+
+	if (!tmff2->payloads) {
+		ret = -ENOMEM;
+		goto payload_err;
+	}
+
+	for (i = 0; i < tmff2->max_effects; ++i) {
+		spin_lock_init(&tmff2->states[i].lock);
+		seqcount_latch_init(&tmff2->states[i].seq);
+		seqcount_latch_init(&tmff2->payloads[i].seq);
+	}
+
 	/* set supported effects into input_dev->ffbit */
 	for (i = 0; tmff2->supported_effects[i] >= 0; ++i)
 		__set_bit(tmff2->supported_effects[i], tmff2->input_dev->ffbit);
@@ -624,7 +2130,10 @@ static int tmff2_wheel_init(struct tmff2_device_entry *tmff2)
 		__set_bit(FF_RUMBLE, tmff2->input_dev->ffbit);
 
 	/* create actual ff device*/
-	if ((ret = input_ff_create(tmff2->input_dev, tmff2->max_effects))) {
+	start = ktime_get();
+	ret = input_ff_create(tmff2->input_dev, tmff2->max_effects);
+	tmff2_boot_mark(tmff2, TMFF2_BOOT_FF_CREATE, start, ktime_get());
+	if (ret) {
 		hid_err(tmff2->hdev, "could not create input_ff\n");
 		goto ff_err;
 	}
@@ -633,6 +2142,7 @@ static int tmff2_wheel_init(struct tmff2_device_entry *tmff2)
 	ff = tmff2->input_dev->ff;
 	ff->upload = tmff2_upload;
 	ff->playback = tmff2_play;
+	ff->erase = tmff2_erase;
 
 	if (tmff2->open)
 		tmff2->input_dev->open = tmff2_open;
@@ -641,30 +2151,33 @@ static int tmff2_wheel_init(struct tmff2_device_entry *tmff2)
 		tmff2->input_dev->close = tmff2_close;
 
 	/* set defaults wherever possible */
-	if (tmff2->set_gain) {
+	if (tmff2->set_gain)
 		ff->set_gain = tmff2_set_gain;
-		tmff2->set_gain(tmff2->data, (GAIN_MAX * gain) / GAIN_MAX);
-	}
 
 	if (tmff2->set_autocenter)
 		ff->set_autocenter = tmff2_set_autocenter;
 
-	if (tmff2->set_range)
-		tmff2->set_range(tmff2->data, range);
-
 	if (tmff2->switch_mode)
-		tmff2->switch_mode(tmff2->data, alt_mode);
+		tmff2->switch_mode(tmff2->data, tmff2->settings.alt_mode);
 
 	/* create files */
-	if ((ret = tmff2_create_files(tmff2)))
+	start = ktime_get();
+	ret = tmff2_create_files(tmff2);
+	tmff2_boot_mark(tmff2, TMFF2_BOOT_SYSFS, start, ktime_get());
+	if (ret)
 		goto file_err;
 
 	tmff2->allow_scheduling = 1;
+
+	/* range, gain etc. go out as one burst from the work handler */
+	tmff2_queue_settings(tmff2);
 	return 0;
 
 file_err:
 	input_ff_destroy(tmff2->input_dev);
 ff_err:
+	kfree(tmff2->payloads);
+payload_err:
 	kfree(tmff2->states);
 err:
 	return ret;
@@ -674,8 +2187,8 @@ static int tmff2_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	struct tmff2_device_entry *tmff2 =
 		kzalloc(sizeof(struct tmff2_device_entry), GFP_KERNEL);
-
-	int ret;
+	ktime_t start;
+	int ret, i;
 
 
 	if (!tmff2) {
@@ -683,7 +2196,23 @@ static int tmff2_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto oom_err;
 	}
 
+	tmff2->boot.probe = ktime_get();
 	tmff2->hdev = hdev;
+
+	/* module parameters are only defaults, each wheel has its own copy */
+	tmff2->settings.spring_level = spring_level;
+	tmff2->settings.damper_level = damper_level;
+	tmff2->settings.friction_level = friction_level;
+	tmff2->settings.range = range;
+	tmff2->settings.gain = gain;
+	tmff2->settings.autocenter = -1;
+	tmff2->settings.alt_mode = alt_mode;
+	spin_lock_init(&tmff2->settings_lock);
+	tmff2->ff_gain = GAIN_MAX;
+	for (i = 0; i < TMFF2_CMDS; ++i)
+		tmff2->commands[i].sent = -1;
+
+	tmff2_restore_profile(tmff2);
 	hid_set_drvdata(tmff2->hdev, tmff2);
 
 	switch (tmff2->hdev->product) {
@@ -694,45 +2223,93 @@ static int tmff2_probe(struct hid_device *hdev, const struct hid_device_id *id)
 				goto wheel_err;
 			break;
 
-		case TMT248_PC_ID:
-			if ((ret = t248_populate_api(tmff2)))
+		/* the rest are described by the table in hid-tmgeneric.c */
+		default:
+			if ((ret = tmgeneric_populate_api(tmff2)))
 				goto wheel_err;
 			break;
+	}
 
-		case TX_ACTIVE:
-			if ((ret = tx_populate_api(tmff2)))
-				goto wheel_err;
-			break;
-		case TSXW_ACTIVE:
-			if ((ret = tsxw_populate_api(tmff2)))
-				goto wheel_err;
-			break;
-			case TMTS_PC_RACER_ID:
-			if ((ret = tspc_populate_api(tmff2)))
-				goto wheel_err;
-			break;
-		default:
-			ret = -ENODEV;
-			goto wheel_err;
+	if (tmff2->family == TMFF2_FAMILY_GENERIC && (!tmff2->normalise_effect
+				|| !tmff2->play_effect
+				|| !tmff2->upload_effect
+				|| !tmff2->update_effect
+				|| !tmff2->stop_effect)) {
+		hid_err(hdev, "missing effect callbacks\n");
+		ret = -EINVAL;
+		goto wheel_err;
 	}
 
-	if ((ret = hid_parse(tmff2->hdev))) {
+	start = ktime_get();
+	ret = hid_parse(tmff2->hdev);
+	tmff2_boot_mark(tmff2, TMFF2_BOOT_PARSE, start, ktime_get());
+	if (ret) {
 		hid_err(hdev, "parse failed\n");
 		goto hid_err;
 	}
 
-	if ((ret = hid_hw_start(tmff2->hdev, HID_CONNECT_DEFAULT & ~HID_CONNECT_FF))) {
+	start = ktime_get();
+	ret = hid_hw_start(tmff2->hdev, HID_CONNECT_DEFAULT & ~HID_CONNECT_FF);
+	tmff2_boot_mark(tmff2, TMFF2_BOOT_HW_START, start, ktime_get());
+	if (ret) {
 		hid_err(hdev, "hw start failed\n");
 		goto hid_err;
 	}
 
 	tmff2->input_dev = list_entry(hdev->inputs.next, struct hid_input, list)->input;
+	tmff2_frames_init(tmff2);
 
 	if ((ret = tmff2_wheel_init(tmff2))) {
 		hid_err(hdev, "init failed\n");
 		goto init_err;
 	}
 
+	if (tmff2_input_init(tmff2))
+		hid_warn(hdev, "could not set up input report decoding\n");
+	else if (tmff2_input_create_files(tmff2))
+		hid_warn(hdev, "unable to create sysfs for calibration\n");
+
+	if (tmff2_trace_init(tmff2))
+		hid_warn(hdev, "session recording not available\n");
+
+	if (tmff2_client_init(tmff2))
+		hid_warn(hdev, "per client budgets not available\n");
+
+	if (tmff2_cdev_init(tmff2))
+		hid_warn(hdev, "raw command device not available\n");
+
+	/* the wheel is opened by init if it isn't opened on open, so it can
+	 * idle from the start */
+	if (idle_msecs && !open_mode)
+		tmff2_kick(tmff2, 0);
+
+	tmff2->boot.ready = ktime_get();
+	hid_dbg(hdev, "force feedback ready %lld us after probe\n",
+			ktime_us_delta(tmff2->boot.ready, tmff2->boot.probe));
+
+	tmff2->debugfs = debugfs_create_dir(dev_name(&hdev->dev),
+			tmff2_debugfs_root);
+	debugfs_create_file("boot_timeline", 0444, tmff2->debugfs, tmff2,
+			&tmff2_boot_timeline_fops);
+	debugfs_create_file("commands", 0444, tmff2->debugfs, tmff2,
+			&tmff2_commands_fops);
+	debugfs_create_file("shadow", 0444, tmff2->debugfs, tmff2,
+			&tmff2_shadow_fops);
+	debugfs_create_file_unsafe("resync", 0200, tmff2->debugfs, tmff2,
+			&tmff2_resync_fops);
+	debugfs_create_file("frames", 0444, tmff2->debugfs, tmff2,
+			&tmff2_frames_fops);
+	debugfs_create_file("power", 0444, tmff2->debugfs, tmff2,
+			&tmff2_power_fops);
+	if (tmff2->stream.slot >= 0)
+		debugfs_create_file("stream", 0444, tmff2->debugfs, tmff2,
+				&tmff2_stream_fops);
+	tmff2_input_debugfs(tmff2, tmff2->debugfs);
+	tmff2_trace_debugfs(tmff2, tmff2->debugfs);
+	tmff2_client_debugfs(tmff2, tmff2->debugfs);
+	tmff2_cdev_debugfs(tmff2, tmff2->debugfs);
+	tmff2_fault_debugfs(tmff2, tmff2->debugfs);
+
 	return 0;
 
 init_err:
@@ -764,6 +2341,17 @@ static const __u8 *tmff2_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 	return rdesc;
 }
 
+static int tmff2_raw_event(struct hid_device *hdev, struct hid_report *report,
+		u8 *data, int size)
+{
+	struct tmff2_device_entry *tmff2 = hid_get_drvdata(hdev);
+
+	if (!tmff2)
+		return 0;
+
+	return tmff2_input_raw_event(tmff2, report, data, size);
+}
+
 static void tmff2_remove(struct hid_device *hdev)
 {
 	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(hdev);
@@ -772,10 +2360,18 @@ static void tmff2_remove(struct hid_device *hdev)
 	if (!tmff2)
 		return;
 
+	debugfs_remove_recursive(tmff2->debugfs);
+
 	tmff2->allow_scheduling = 0;
 	cancel_delayed_work_sync(&tmff2->work);
+	cancel_delayed_work_sync(&tmff2->idle_work);
+	tmff2_power_put(tmff2);
+	tmff2_cdev_destroy(tmff2);
 
 	dev = &tmff2->hdev->dev;
+	device_remove_file(dev, &dev_attr_profile);
+	tmff2_input_remove_files(tmff2);
+
 	if (tmff2->params & PARAM_FRICTION_LEVEL)
 		device_remove_file(dev, &dev_attr_friction_level);
 
@@ -795,8 +2391,12 @@ static void tmff2_remove(struct hid_device *hdev)
 		device_remove_file(dev, &dev_attr_gain);
 
 	hid_hw_stop(hdev);
+	tmff2_input_destroy(tmff2);
+	tmff2_trace_destroy(tmff2);
+	tmff2_client_destroy(tmff2);
 	tmff2->wheel_destroy(tmff2->data);
 
+	kfree(tmff2->payloads);
 	kfree(tmff2->states);
 	kfree(tmff2);
 }
@@ -819,13 +2419,113 @@ static const struct hid_device_id tmff2_devices[] = {
 };
 MODULE_DEVICE_TABLE(hid, tmff2_devices);
 
+#ifdef CONFIG_PM
+/* the wheel loses everything while the system sleeps. Sending stops on
+ * suspend, and since the shadow already tracks what the wheel should hold, a
+ * resync on resume replays it all in one tick. */
+static int tmff2_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(hdev);
+
+	if (!tmff2)
+		return 0;
+
+	/* autosuspend of an idle wheel, uploads and plays still have to get
+	 * to the work handler to wake it up again */
+	if (PMSG_IS_AUTO(message))
+		return 0;
+
+	tmff2->power.sleeping = true;
+	tmff2->allow_scheduling = 0;
+	cancel_delayed_work_sync(&tmff2->work);
+	cancel_delayed_work_sync(&tmff2->idle_work);
+	return 0;
+}
+
+static void tmff2_resume_replay(struct tmff2_device_entry *tmff2)
+{
+	tmff2->power.sleeping = false;
+	tmff2->allow_scheduling = 1;
+	tmff2->power.resumed++;
+
+	/* an idle wheel is closed anyway and gets everything when woken up */
+	if (tmff2->power.idle) {
+		if (tmff2_requested(tmff2))
+			tmff2_kick(tmff2, 0);
+		return;
+	}
+
+	tmff2->power.resumed_at = ktime_get();
+	tmff2->power.resuming = true;
+	tmff2_queue_resync(tmff2);
+}
+
+static int tmff2_resume(struct hid_device *hdev)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(hdev);
+
+	/* nothing was stopped for a runtime resume and the wheel kept its
+	 * state */
+	if (!tmff2 || !tmff2->power.sleeping)
+		return 0;
+
+	tmff2_resume_replay(tmff2);
+	return 0;
+}
+
+/* the wheel lost its state in the reset, replay it whichever way it was
+ * suspended */
+static int tmff2_reset_resume(struct hid_device *hdev)
+{
+	struct tmff2_device_entry *tmff2 = tmff2_from_hdev(hdev);
+
+	if (tmff2)
+		tmff2_resume_replay(tmff2);
+	return 0;
+}
+#endif
+
 static struct hid_driver tmff2_driver = {
 	.name = "tmff2",
 	.id_table = tmff2_devices,
 	.probe = tmff2_probe,
 	.remove = tmff2_remove,
 	.report_fixup = tmff2_report_fixup,
+	.raw_event = tmff2_raw_event,
+	.input_configured = tmff2_input_configured,
+#ifdef CONFIG_PM
+	.suspend = tmff2_suspend,
+	.resume = tmff2_resume,
+	.reset_resume = tmff2_reset_resume,
+#endif
+	/* wheel bring-up talks to the device and can take a while, don't hold
+	 * up the rest of the USB bus while it does */
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
-module_hid_driver(tmff2_driver);
+
+static int __init tmff2_init(void)
+{
+	int ret;
+
+	tmff2_debugfs_root = debugfs_create_dir("tmff2", NULL);
+	tmff2_fault_init(tmff2_debugfs_root);
+
+	if ((ret = hid_register_driver(&tmff2_driver)))
+		debugfs_remove_recursive(tmff2_debugfs_root);
+
+	return ret;
+}
+
+static void __exit tmff2_exit(void)
+{
+	hid_unregister_driver(&tmff2_driver);
+	debugfs_remove_recursive(tmff2_debugfs_root);
+	tmff2_free_profiles();
+}
+
+module_init(tmff2_init);
+module_exit(tmff2_exit);
 
 MODULE_LICENSE("GPL");
@@ -5,14 +5,12 @@
 #include <linux/fixp-arith.h>
 #include <linux/ktime.h>
 #include <linux/input.h>
+#include <linux/seqlock.h>
+#include "hid-tmff2-sched.h"
 
 extern int timer_msecs;
-extern int spring_level;
-extern int damper_level;
-extern int friction_level;
-extern int range;
-extern int gain;
-extern int alt_mode;
+extern int hid_bpf_output;
+extern int pack_commands;
 
 #define USB_VENDOR_ID_THRUSTMASTER 0x044f
 
@@ -24,12 +22,6 @@ extern int alt_mode;
  */
 #define DEFAULT_TIMER_PERIOD	8
 
-#define FF_EFFECT_QUEUE_UPLOAD	0
-#define FF_EFFECT_QUEUE_START	1
-#define FF_EFFECT_QUEUE_STOP	2
-#define FF_EFFECT_QUEUE_UPDATE	3
-#define FF_EFFECT_PLAYING	4
-
 #define PARAM_SPRING_LEVEL	(1 << 0)
 #define PARAM_DAMPER_LEVEL	(1 << 1)
 #define PARAM_FRICTION_LEVEL	(1 << 2)
@@ -44,47 +36,356 @@ extern int alt_mode;
 
 #define JIFFIES2MS(jiffies) ((jiffies) * 1000 / HZ)
 
-struct tmff2_effect_state {
-	struct ff_effect effect;
-	struct ff_effect old;
+/* protocol families. All currently supported wheels speak the T300RS protocol,
+ * so effect commands for that family are dispatched with direct calls instead
+ * of going through the function pointers below, which with retpolines/IBT
+ * enabled are not free at high update rates. TMFF2_FAMILY_GENERIC is for
+ * backends that really do need their own effect callbacks. */
+enum tmff2_family {
+	TMFF2_FAMILY_GENERIC = 0,
+	TMFF2_FAMILY_T300RS,
+};
 
+/* effect parameters, normalised into a device-ready format by the backend
+ * when the effect is uploaded so that the work handler and the encoders don't
+ * have to redo the scaling on every tick. Records are zeroed before being
+ * filled in, so two of them can be compared with memcmp. */
+struct tmff2_effect_params {
+	__u16 type;
+	__u16 duration;	/* wheel format, i.e. infinite is not 0 */
+	__u16 delay;
+
+	union {
+		struct {
+			__s16 level;
+			struct ff_envelope envelope;
+		} constant;
+
+		struct {
+			__u16 slope;
+			__s16 center;
+			__u8 invert;
+			struct ff_envelope envelope;
+		} ramp;
+
+		struct {
+			__s16 right_coeff;
+			__s16 left_coeff;
+			__s16 right_deadband;
+			__s16 left_deadband;
+			__u16 right_saturation;
+			__u16 left_saturation;
+		} condition;
+
+		struct {
+			__s16 magnitude;
+			__s16 offset;
+			__u16 phase;
+			__u16 period;
+			__u8 waveform;
+			struct ff_envelope envelope;
+		} periodic;
+	} u;
+};
+
+/* scheduling state of an effect slot, touched by the work handler for every
+ * slot on every tick so keep it small. The whole array fits into a few cache
+ * lines, the effect parameters live separately in tmff2_effect_payload.
+ *
+ * ff-core callbacks never wait on the work handler: they publish into the
+ * latched copies below and then set the request bits in flags with atomic
+ * bitops. Uploads only hold ff->mutex and plays the input core's event_lock,
+ * so writers of the latch take the slot's lock, which also keeps either one
+ * from dropping the fields the other just changed. The work handler takes the
+ * bits with test_and_clear_bit and reads a consistent copy from the latch
+ * without any lock. FF_EFFECT_PLAYING is only ever set and cleared by the
+ * work handler. */
+struct tmff2_effect_state {
 	unsigned long flags;
-	unsigned long count;
-	unsigned long start_time;
+	spinlock_t lock;
+	u8 rank;	/* work handler only, where the slot goes this tick */
+	seqcount_latch_t seq;
+	struct tmff2_effect_timing timing[2];
+};
+
+/* in tmff2_effect_state.flags next to the FF_EFFECT_* bits, owned by the work
+ * handler: the slot is out of sync with the wheel and has to be resynced */
+#define FF_EFFECT_RESYNC	5
+
+/* set by ff-core for constant force effects, which the work handler sends
+ * before anything else */
+#define FF_EFFECT_CONSTANT	6
+
+/* shadow of an effect slot on the wheel, bits in tmff2_effect_payload.held
+ * for what the wheel holds and .wanted for what it should hold */
+#define TMFF2_SLOT_LOADED	0
+#define TMFF2_SLOT_PLAYING	1
+
+/* in .held only, raw commands from the character device went to the slot
+ * and the wheel may be playing anything in it */
+#define TMFF2_SLOT_RAW		2
+
+/* failed sends are retried with exponential backoff starting at the timer
+ * period, after this many attempts the target is left alone until it is
+ * requested again or a resync is triggered */
+#define TMFF2_MAX_RETRIES	5
+
+/* effect parameters, only needed when something is sent to the wheel */
+struct tmff2_effect_payload {
+	seqcount_latch_t seq;
+	struct tmff2_effect_params effect[2];
+
+	/* owned by the work handler, what was last sent to the wheel */
+	struct tmff2_effect_params sent;
+	unsigned long held;
+	unsigned long wanted;
+	unsigned int retries;	/* failed attempts, 0 while in sync */
+	unsigned long retry_at;	/* jiffies */
+	ktime_t diverged;
+};
+
+/* phases between probe and the wheel being usable, timed to see where bring-up
+ * spends its time. Firmware, attachment and setup happen inside the backend's
+ * wheel_init and are included in its time as well. */
+enum tmff2_boot_phase {
+	TMFF2_BOOT_PARSE,
+	TMFF2_BOOT_HW_START,
+	TMFF2_BOOT_WHEEL_INIT,
+	TMFF2_BOOT_FIRMWARE,
+	TMFF2_BOOT_ATTACHMENT,
+	TMFF2_BOOT_SETUP,
+	TMFF2_BOOT_FF_CREATE,
+	TMFF2_BOOT_SYSFS,
+	TMFF2_BOOT_PHASES
+};
+
+struct tmff2_boot_timeline {
+	ktime_t probe;
+	ktime_t ready;
+	unsigned long seen;
+	s64 phase_ns[TMFF2_BOOT_PHASES];
+};
+
+/* per-device tunables. The module parameters of the same names are only used
+ * to initialise these when a wheel is probed, after that each wheel has its
+ * own copy that is changed through sysfs. */
+struct tmff2_settings {
+	int spring_level;
+	int damper_level;
+	int friction_level;
+	int range;
+	int gain;
+	int autocenter;
+	int alt_mode;
+};
+
+/* out-of-band commands. ff-core and sysfs only record the latest value and
+ * the work handler sends it on its next tick if it differs from what the
+ * wheel was last sent, so a burst of requests turns into at most one command
+ * per tick. The enum values double as bits in tmff2_device_entry.pending. */
+enum tmff2_command {
+	TMFF2_CMD_RANGE,
+	TMFF2_CMD_GAIN,
+	TMFF2_CMD_AUTOCENTER,
+	TMFF2_CMDS
+};
+
+struct tmff2_command_state {
+	atomic_long_t requested;
+
+	/* owned by the work handler */
+	int sent;	/* last value sent, -1 if unknown */
+	unsigned long nr_sent;
+	unsigned long nr_unchanged;
+	unsigned int retries;
+	unsigned long retry_at;
+	ktime_t diverged;
+};
+
+/* device-wide requests for the work handler, in tmff2_device_entry.pending,
+ * after the command bits. TMFF2_PENDING_SETTINGS resends every command,
+ * TMFF2_PENDING_RESYNC forgets the shadow of the wheel and brings everything
+ * on it back in line. */
+#define TMFF2_PENDING_SETTINGS	TMFF2_CMDS
+#define TMFF2_PENDING_RESYNC	(TMFF2_CMDS + 1)
+/* set by the idle timer, see idle_msecs */
+#define TMFF2_PENDING_IDLE	(TMFF2_CMDS + 2)
+/* raw commands were queued through the character device */
+#define TMFF2_PENDING_RAW	(TMFF2_CMDS + 3)
+/* the torque stream mailbox was mapped or unmapped */
+#define TMFF2_PENDING_STREAM	(TMFF2_CMDS + 4)
+
+/* direct input report decoder, see hid-tmff2-input.c */
+struct tmff2_input;
+
+/* a negative return from raw_event makes hid-core skip its own processing of
+ * the report */
+#define TMFF2_INPUT_CONSUMED	(-EALREADY)
+
+/* output fault injection and recovery tracking, see hid-tmff2-fault.c */
+enum tmff2_fault {
+	TMFF2_FAULT_NONE = 0,
+	TMFF2_FAULT_DROP,
+	TMFF2_FAULT_ERROR,
+};
+
+struct tmff2_recovery {
+	bool faulted;
+	unsigned long injected;
+	unsigned long delayed;
+	unsigned long diverged;
+	unsigned long recovered;
+	s64 total_ns;
+	s64 max_ns;
+};
+
+/* state for closing the wheel while nothing plays and for system suspend.
+ * idle is read locklessly by the ff-core callbacks to note when a wake up was
+ * requested, everything else is owned by the work handler. */
+struct tmff2_power {
+	bool idle;
+	bool powered;	/* holding a PM_HINT_FULLON reference */
+	ktime_t wake_request;
+	unsigned long idled;
+	unsigned long woken;
+	s64 wake_total_ns;
+	s64 wake_max_ns;
+
+	/* suspended for system sleep, runtime suspend leaves the worker alone */
+	bool sleeping;
+
+	/* system resume, until the replay of the wheel state is sent */
+	bool resuming;
+	ktime_t resumed_at;
+	unsigned long resumed;
+	s64 resume_ns;
+};
+
+/* torque streamed through a mailbox mapped from the character device, see
+ * hid-tmff2-cdev.c. The slot is taken out of max_effects at probe and is
+ * owned by the work handler. */
+struct tmff2_stream {
+	int slot;	/* -1 if not reserved */
+	bool loaded;	/* the constant force in slot is playing */
+	u32 seq;	/* of the last level sent */
+	unsigned long started;
+	unsigned long samples;
+	unsigned long missed;	/* overwritten before they were sent */
+	unsigned long failed;
+};
+
+/* ff-core session recorder, see hid-tmff2-trace.c */
+struct tmff2_trace;
+
+/* per process arbitration of effect slots, see hid-tmff2-client.c */
+struct tmff2_clients;
+
+#define TMFF2_CLIENT_PRIORITIES	4
+
+/* raw command channel, see hid-tmff2-cdev.c */
+struct tmff2_cdev;
+
+/* timing of the work handler against the frames of the USB bus. interval is
+ * the service interval of the interrupt OUT endpoint, spans counts how many
+ * frames the sends of a tick took and phases where in the service interval
+ * ticks started. */
+#define TMFF2_FRAME_BUCKETS	8
+
+struct tmff2_frames {
+	struct usb_device *usbdev;	/* NULL if not on USB */
+	unsigned int interval_us;
+	unsigned int interval_ms;
+	unsigned long ticks;
+	unsigned long spans[TMFF2_FRAME_BUCKETS];
+	unsigned long phases[TMFF2_FRAME_BUCKETS];
 };
 
 struct tmff2_device_entry {
 	struct hid_device *hdev;
 	struct input_dev *input_dev;
 
-	/* pointer to array */
+	/* pointers to arrays, indexed by effect id */
 	struct tmff2_effect_state *states;
+	struct tmff2_effect_payload *payloads;
 
 	struct delayed_work work;
-
-	spinlock_t lock;
+	struct delayed_work idle_work;
 
 	int allow_scheduling;
 
+	/* the input device is open, i.e. the wheel was sent the open command */
+	bool opened;
+
+	/* settings_lock is held by every writer of settings once the wheel is
+	 * probed, so that the work handler and the profile attribute see a
+	 * consistent block */
+	spinlock_t settings_lock;
+	struct tmff2_settings settings;
+	unsigned long pending;
+
+	/* gain as set by ff-core, scaled by settings.gain when sent */
+	u16 ff_gain;
+	struct tmff2_command_state commands[TMFF2_CMDS];
+
+	/* NULL unless input reports are decoded directly */
+	struct tmff2_input *input;
+
+	struct tmff2_boot_timeline boot;
+	struct dentry *debugfs;
+
+	/* updated by whoever sends, which is nearly always the work handler */
+	struct tmff2_recovery recovery;
+
+	/* set while a session is being recorded */
+	bool tracing;
+	struct tmff2_trace *trace;
+
+	struct tmff2_clients *clients;
+	struct tmff2_cdev *cdev;
+
+	/* owned by the work handler after probe */
+	struct tmff2_frames frames;
+	struct tmff2_power power;
+	struct tmff2_stream stream;
+
 	/* fields relevant to each actual device (T300, T248...) */
+	enum tmff2_family family;
 	void *data;
 	unsigned long params;
 	unsigned long max_effects;
+	u16 range_min, range_max;	/* degrees, for set_range */
 	signed short supported_effects[FF_CNT];
 
-	/* obligatory callbacks */
-	int (*play_effect)(void *data, const struct tmff2_effect_state *state);
-	int (*upload_effect)(void *data, const struct tmff2_effect_state *state);
-	int (*update_effect)(void *data, const struct tmff2_effect_state *state);
-	int (*stop_effect)(void *data, const struct tmff2_effect_state *state);
+	/* obligatory callbacks for TMFF2_FAMILY_GENERIC, unused otherwise */
+	int (*normalise_effect)(void *data, const struct ff_effect *effect,
+			struct tmff2_effect_params *params);
+	int (*play_effect)(void *data, int id, unsigned long count);
+	int (*upload_effect)(void *data, int id,
+			const struct tmff2_effect_params *effect);
+	int (*update_effect)(void *data, int id,
+			const struct tmff2_effect_params *effect,
+			const struct tmff2_effect_params *old);
+	int (*stop_effect)(void *data, int id);
 
+	/* obligatory callbacks */
 	int (*wheel_init)(struct tmff2_device_entry *tmff2, int open_mode);
 	int (*wheel_destroy)(void *data);
 
 	/* optional callbacks */
 	int (*open)(void *data, int);
 	int (*close)(void *data, int);
+	/* send the open or close command only, for resyncing a wheel that is
+	 * open and for closing it while idle */
+	int (*send_open)(void *data);
+	int (*send_close)(void *data);
+	/* raw commands from userspace. check_raw returns the effect slot a
+	 * command is for, or a negative error if it isn't allowed */
+	int (*check_raw)(void *data, const u8 *buf, size_t len);
+	int (*send_raw)(void *data, const u8 *buf, size_t len);
+	/* change only the level of a constant force, for torque streaming */
+	int (*send_level)(void *data, int id, int16_t level);
 	int (*set_gain)(void *data, uint16_t gain);
+	/* returns the range actually set, within range_min and range_max */
 	int (*set_range)(void *data, uint16_t range);
 	/* switch_mode is required to not do anything if we're alredy in the
 	 * specified mode */
@@ -99,11 +400,73 @@ struct tmff2_device_entry {
 };
 
 /* external */
+void tmff2_boot_mark(struct tmff2_device_entry *tmff2,
+		enum tmff2_boot_phase phase, ktime_t start, ktime_t end);
+
+int tmff2_input_init(struct tmff2_device_entry *tmff2);
+void tmff2_input_destroy(struct tmff2_device_entry *tmff2);
+int tmff2_input_create_files(struct tmff2_device_entry *tmff2);
+void tmff2_input_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir);
+int tmff2_input_configured(struct hid_device *hdev, struct hid_input *hi);
+void tmff2_input_remove_files(struct tmff2_device_entry *tmff2);
+int tmff2_input_raw_event(struct tmff2_device_entry *tmff2,
+		struct hid_report *report, u8 *data, int size);
+
+int tmff2_trace_init(struct tmff2_device_entry *tmff2);
+void tmff2_trace_destroy(struct tmff2_device_entry *tmff2);
+void tmff2_trace_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir);
+void tmff2_trace_upload(struct tmff2_device_entry *tmff2,
+		const struct ff_effect *effect, bool update);
+void tmff2_trace_event(struct tmff2_device_entry *tmff2, u8 type,
+		s16 id, s32 value);
+struct tmff2_trace_effect;
+void tmff2_trace_to_effect(const struct tmff2_trace_effect *e,
+		struct ff_effect *effect);
+
+int tmff2_client_init(struct tmff2_device_entry *tmff2);
+void tmff2_client_destroy(struct tmff2_device_entry *tmff2);
+void tmff2_client_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir);
+void tmff2_client_upload(struct tmff2_device_entry *tmff2, int id);
+void tmff2_client_erase(struct tmff2_device_entry *tmff2, int id);
+void tmff2_client_play(struct tmff2_device_entry *tmff2, int id);
+int tmff2_client_priority(struct tmff2_device_entry *tmff2, int id);
+bool tmff2_client_owns(struct tmff2_device_entry *tmff2, int id);
+bool tmff2_client_throttled(struct tmff2_device_entry *tmff2, int id,
+		unsigned long flags);
+void tmff2_client_charge(struct tmff2_device_entry *tmff2, int id,
+		unsigned long actions);
+
+int tmff2_cdev_init(struct tmff2_device_entry *tmff2);
+void tmff2_cdev_destroy(struct tmff2_device_entry *tmff2);
+void tmff2_cdev_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir);
+int tmff2_cdev_priority(struct tmff2_device_entry *tmff2);
+bool tmff2_cdev_dispatch(struct tmff2_device_entry *tmff2, bool *sent);
+bool tmff2_cdev_stream(struct tmff2_device_entry *tmff2, s16 *level, u32 *seq);
+void tmff2_cdev_stream_ack(struct tmff2_device_entry *tmff2, u32 seq);
+void tmff2_queue_stream(struct tmff2_device_entry *tmff2);
+void tmff2_queue_raw(struct tmff2_device_entry *tmff2);
+struct tmff2_batch_entry;
+int tmff2_batch(struct tmff2_device_entry *tmff2,
+		const struct tmff2_batch_entry *entries, unsigned int count);
+
+#ifdef CONFIG_FAULT_INJECTION
+enum tmff2_fault tmff2_inject_fault(struct hid_device *hdev);
+void tmff2_fault_init(struct dentry *root);
+#else
+static inline enum tmff2_fault tmff2_inject_fault(struct hid_device *hdev)
+{
+	return TMFF2_FAULT_NONE;
+}
+
+static inline void tmff2_fault_init(struct dentry *root) {}
+#endif
+void tmff2_fault_begin(struct tmff2_device_entry *tmff2);
+void tmff2_fault_end(struct tmff2_device_entry *tmff2, ktime_t *since,
+		int ret);
+void tmff2_fault_debugfs(struct tmff2_device_entry *tmff2, struct dentry *dir);
+
 int t300rs_populate_api(struct tmff2_device_entry *tmff2);
-int t248_populate_api(struct tmff2_device_entry *tmff2);
-int tx_populate_api(struct tmff2_device_entry *tmff2);
-int tsxw_populate_api(struct tmff2_device_entry *tmff2);
-int tspc_populate_api(struct tmff2_device_entry *tmff2);
+int tmgeneric_populate_api(struct tmff2_device_entry *tmff2);
 
 #define TMT300RS_PS3_NORM_ID	0xb66e
 #define TMT300RS_PS3_ADV_ID	0xb66f
@@ -121,6 +484,9 @@ int tspc_populate_api(struct tmff2_device_entry *tmff2);
 /* T248 and TX at least uses the T300RS api, not sure if there are other wheels
  * but that's why these functions are given global linkage */
 
+/* the largest output report of the family */
+#define T300RS_PACK_LENGTH	63
+
 struct t300rs_device_entry {
 	struct hid_device *hdev;
 	struct input_dev *input_dev;
@@ -128,6 +494,9 @@ struct t300rs_device_entry {
 	struct hid_field *ff_field;
 	struct usb_device *usbdev;
 
+	/* owned by the tmff2_device_entry */
+	struct tmff2_settings *settings;
+
 	int (*open)(struct input_dev *dev);
 	void (*close)(struct input_dev *dev);
 
@@ -135,20 +504,35 @@ struct t300rs_device_entry {
 	int attachment;
 	u8 buffer_length;
 	u8 *send_buffer;
+
+	/* short commands waiting to share a report, see t300rs_send_short */
+	u8 pack_len;
+	bool pack_failed;
+	bool pack_lost;
+	u8 pack_buffer[T300RS_PACK_LENGTH];
 };
 
-int t300rs_play_effect(void *, const struct tmff2_effect_state *);
-int t300rs_upload_effect(void *, const struct tmff2_effect_state *);
-int t300rs_update_effect(void *, const struct tmff2_effect_state *);
-int t300rs_stop_effect(void *, const struct tmff2_effect_state *);
+int t300rs_normalise_effect(void *, const struct ff_effect *,
+		struct tmff2_effect_params *);
+int t300rs_play_effect(void *, int, unsigned long);
+int t300rs_upload_effect(void *, int, const struct tmff2_effect_params *);
+int t300rs_update_effect(void *, int, const struct tmff2_effect_params *,
+		const struct tmff2_effect_params *);
+int t300rs_stop_effect(void *, int);
 
 int t300rs_open(void *, int);
 int t300rs_close(void *, int);
 int t300rs_set_gain(void *, uint16_t);
 int t300rs_set_range(void *, uint16_t);
 int t300rs_set_autocenter(void *, uint16_t);
+int t300rs_check_raw(void *, const u8 *, size_t);
+int t300rs_send_raw(void *, const u8 *, size_t);
+int t300rs_send_level(void *, int, int16_t);
+int t300rs_flush(void *);
 
 int t300rs_send_buf(struct t300rs_device_entry *t300rs, u8 *send_buffer, size_t len);
 int t300rs_send_int(struct t300rs_device_entry *t300rs);
+int t300rs_send_setup(struct t300rs_device_entry *t300rs,
+		const u8 *const *packets, const unsigned int *sizes, size_t count);
 
 #endif
@@ -0,0 +1,532 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include <linux/usb.h>
+#include <linux/hid.h>
+#include "../hid-tmff2.h"
+
+/* wheels that speak the T300RS protocol but don't need the T300RS's own mode
+ * and attachment handling. What sets them apart from each other is in
+ * tmgeneric_models, supporting another one of these should only take an entry
+ * there and its id in the device table. */
+#define TMGENERIC_MAX_EFFECTS 16
+#define TMGENERIC_BUFFER_LENGTH 63
+
+/* switches the TS-PC between its PC modes */
+#define TMGENERIC_QUIRK_ALT_MODE_CTRL	(1 << 0)
+
+static const u8 setup_0[64] = { 0x42, 0x01 };
+static const u8 setup_1[64] = { 0x0a, 0x04, 0x90, 0x03 };
+static const u8 setup_2[64] = { 0x0a, 0x04, 0x00, 0x0c };
+static const u8 setup_3[64] = { 0x0a, 0x04, 0x12, 0x10 };
+static const u8 setup_4[64] = { 0x0a, 0x04, 0x00, 0x06 };
+static const u8 setup_5[64] = { 0x0a, 0x04, 0x00, 0x0e };
+static const u8 setup_6[64] = { 0x0a, 0x04, 0x00, 0x0e, 0x01 };
+static const u8 *const setup_arr[] = { setup_0, setup_1, setup_2, setup_3, setup_4, setup_5, setup_6 };
+static const unsigned int setup_arr_sizes[] = {
+	ARRAY_SIZE(setup_0),
+	ARRAY_SIZE(setup_1),
+	ARRAY_SIZE(setup_2),
+	ARRAY_SIZE(setup_3),
+	ARRAY_SIZE(setup_4),
+	ARRAY_SIZE(setup_5),
+	ARRAY_SIZE(setup_6)
+};
+
+static const u8 open_commands[][2] = { { 0x01, 0x04 }, { 0x01, 0x05 } };
+static const u8 close_commands[][2] = { { 0x01, 0x05 }, { 0x01, 0x00 } };
+
+static const unsigned long tmgeneric_params =
+	PARAM_SPRING_LEVEL
+	| PARAM_DAMPER_LEVEL
+	| PARAM_FRICTION_LEVEL
+	| PARAM_RANGE
+	| PARAM_GAIN
+	;
+
+static const signed short tmgeneric_effects[] = {
+	FF_CONSTANT,
+	FF_RAMP,
+	FF_SPRING,
+	FF_DAMPER,
+	FF_FRICTION,
+	FF_INERTIA,
+	FF_PERIODIC,
+	FF_SINE,
+	FF_TRIANGLE,
+	FF_SQUARE,
+	FF_SAW_UP,
+	FF_SAW_DOWN,
+	FF_AUTOCENTER,
+	FF_GAIN,
+	-1
+};
+
+/* TODO: sort through this stuff */
+static u8 t248_rdesc_fixed[] = {
+	0x05, 0x01, /* Usage page (Generic Desktop) */
+	0x09, 0x04, /* Usage (Joystick) */
+	0xa1, 0x01, /* Collection (Application) */
+	0x09, 0x01, /* Usage (Pointer) */
+	0xa1, 0x00, /* Collection (Physical) */
+	0x85, 0x07, /* Report ID (7) */
+	0x09, 0x30, /* Usage (X) */
+	0x15, 0x00, /* Logical minimum (0) */
+	0x27, 0xff, 0xff, 0x00, 0x00, /* Logical maximum (65535) */
+	0x35, 0x00, /* Physical minimum (0) */
+	0x47, 0xff, 0xff, 0x00, 0x00, /* Physical maximum (65535) */
+	0x75, 0x10, /* Report size (16) */
+	0x95, 0x01, /* Report count (1) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x31, /* Usage (Y) TODO: clutch? */
+	0x26, 0xff, 0x03, /* Logical maximum (1023) */
+	0x46, 0xff, 0x03, /* Physical maximum (1023) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x35, /* Usage (Rz) TODO: brake? */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x36, /* Usage (Slider) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x75, 0x08, /* Report size (8) */
+	0x26, 0xff, 0x00, /* Logical maximum (255) */
+	0x46, 0xff, 0x00, /* Physical maximum (255) */
+	0x09, 0x40, /* Usage (Vx) TODO: what is this? */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x41, /* Usage (Vy) TODO: --||-- */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x33, /* Usage (Rx) TODO: --||-- */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x34, /* Usage (Ry) TODO: --||-- */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x32, /* Usage (Z) TODO: --||-- (gas?) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x37, /* Usage (Dial) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x05, 0x09, /* Usage page (Button) */
+	0x19, 0x01, /* Usage minimum (1) */
+	0x29, 0x1a, /* Usage maximum (13) */
+	0x25, 0x01, /* Logical maximum (1) */
+	0x45, 0x01, /* Physical maximum (1) */
+	0x75, 0x01, /* Report size (1) */
+	0x95, 0x1a, /* Report count (26) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x75, 0x06, /* Report size (6) */
+	0x95, 0x01, /* Report count (1) */
+	0x81, 0x03, /* Usage (Variable, Absolute, Constant) */
+	0x05, 0x01, /* Usage page (Generic Desktop) */
+	0x09, 0x39, /* Usage (Hat Switch) */
+	0x25, 0x07, /* Logical maximum (7) */
+	0x46, 0x3b, 0x01, /* Physical maximum (315) */
+	0x55, 0x00, /* Unit exponent (0) */
+	0x65, 0x14, /* Unit (Eng rot, Angular Pos) */
+	0x75, 0x04, /* Report size (4) */
+	0x81, 0x42, /* Input (Variable, Absolute, NullState) */
+	0x65, 0x00, /* Input (None) */
+	0x81, 0x03, /* Input (Variable, Absolute, Constant) */
+	0x85, 0x60, /* Report ID (96), prev 10 */
+	0x06, 0x00, 0xff, /* Usage page (Vendor 1) */
+	0x09, 0x60, /* Usage (96), prev 10 */
+	0x75, 0x08, /* Report size (8) */
+	0x95, 0x3f, /* Report count (63) */
+	0x26, 0xff, 0x00, /* Logical maximum (256) */
+	0x46, 0xff, 0x00, /* Physical maximum (256) */
+	0x91, 0x02, /* Output (Variable, Absolute) */
+	0x85, 0x02, /* Report ID (2) */
+	0x09, 0x02, /* Usage (2) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x14, /* Usage (20) */
+	0x85, 0x14, /* Report ID (20) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0xc0, /* End collection */
+	0xc0, /* End collection */
+};
+
+/* TX, TS-XW and TS-PC */
+static u8 tmgeneric_pc_rdesc_fixed[] = {
+	0x05, 0x01, /* Usage page (Generic Desktop) */
+	0x09, 0x04, /* Usage (Joystick) */
+	0xa1, 0x01, /* Collection (Application) */
+	0x09, 0x01, /* Usage (Pointer) */
+	0xa1, 0x00, /* Collection (Physical) */
+	0x85, 0x07, /* Report ID (7) */
+	0x09, 0x30, /* Usage (X) */
+	0x15, 0x00, /* Logical minimum (0) */
+	0x27, 0xff, 0xff, 0x00, 0x00, /* Logical maximum (65535) */
+	0x35, 0x00, /* Physical minimum (0) */
+	0x47, 0xff, 0xff, 0x00, 0x00, /* Physical maximum (65535) */
+	0x75, 0x10, /* Report size (16) */
+	0x95, 0x01, /* Report count (1) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x35, /* Usage (Rz) (Brake) */
+	0x26, 0xff, 0x03, /* Logical maximum (1023) */
+	0x46, 0xff, 0x03, /* Physical maximum (1023) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x32, /* Usage (Z) (Gas) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x31, /* Usage (Y) (Clutch) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x81, 0x03, /* Input (Variable, Absolute, Constant) */
+	0x05, 0x09, /* Usage page (Button) */
+	0x19, 0x01, /* Usage minimum (1) */
+	0x29, 0x0d, /* Usage maximum (13) */
+	0x25, 0x01, /* Logical maximum (1) */
+	0x45, 0x01, /* Physical maximum (1) */
+	0x75, 0x01, /* Report size (1) */
+	0x95, 0x0d, /* Report count (13) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x75, 0x0b, /* Report size (13) */
+	0x95, 0x01, /* Report count (1) */
+	0x81, 0x03, /* Usage (Variable, Absolute, Constant) */
+	0x05, 0x01, /* Usage page (Generic Desktop) */
+	0x09, 0x39, /* Usage (Hat Switch) */
+	0x25, 0x07, /* Logical maximum (7) */
+	0x46, 0x3b, 0x01, /* Physical maximum (315) */
+	0x55, 0x00, /* Unit exponent (0) */
+	0x65, 0x14, /* Unit (Eng Rot, Angular Pos) */
+	0x75, 0x04, /* Report size (4) */
+	0x81, 0x42, /* Input (Variable, Absolute, NullState) */
+	0x65, 0x00, /* Unit (None) */
+	0x81, 0x03, /* Input (Variable, Absolute, Constant) */
+	0x85, 0x60, /* Report ID (96), prev 10 */
+	0x06, 0x00, 0xff, /* Usage page (Vendor 1) */
+	0x09, 0x60, /* Usage (96), prev 10 */
+	0x75, 0x08, /* Report size (8) */
+	0x95, 0x3f, /* Report count (63) */
+	0x26, 0xff, 0x7f, /* Logical maximum (32767) */
+	0x15, 0x00, /* Logical minimum (0) */
+	0x46, 0xff, 0x7f, /* Physical maximum (32767) */
+	0x36, 0x00, 0x80, /* Physical minimum (-32768) */
+	0x91, 0x02, /* Output (Variable, Absolute) */
+	0x85, 0x02, /* Report ID (2) */
+	0x09, 0x02, /* Usage (2) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0x09, 0x14, /* Usage (20) */
+	0x85, 0x14, /* Report ID (20) */
+	0x81, 0x02, /* Input (Variable, Absolute) */
+	0xc0, /* End collection */
+	0xc0, /* End collection */
+};
+
+struct tmgeneric_setup {
+	const u8 *const *packets;
+	const unsigned int *sizes;
+	unsigned int count;
+};
+
+struct tmgeneric_sequence {
+	const u8 (*commands)[2];
+	unsigned int count;
+};
+
+static const struct tmgeneric_setup setup_sequence = {
+	.packets = setup_arr,
+	.sizes = setup_arr_sizes,
+	.count = ARRAY_SIZE(setup_arr),
+};
+
+static const struct tmgeneric_sequence open_sequence = {
+	.commands = open_commands,
+	.count = ARRAY_SIZE(open_commands),
+};
+
+static const struct tmgeneric_sequence close_sequence = {
+	.commands = close_commands,
+	.count = ARRAY_SIZE(close_commands),
+};
+
+struct tmgeneric_model {
+	u16 product;
+	const char *name;
+	u8 *rdesc;
+	unsigned int rdesc_size;
+	u16 range_min;
+	u16 range_max;
+	unsigned long params;
+	unsigned long quirks;
+	const struct tmgeneric_setup *setup;
+	const struct tmgeneric_sequence *open;
+	const struct tmgeneric_sequence *close;
+};
+
+static const struct tmgeneric_model tmgeneric_models[] = {
+	{
+		.product = TMT248_PC_ID,
+		.name = "T248",
+		.rdesc = t248_rdesc_fixed,
+		.rdesc_size = sizeof(t248_rdesc_fixed),
+		.range_min = 140,
+		.range_max = 900,
+		.params = tmgeneric_params,
+		.setup = &setup_sequence,
+		.open = &open_sequence,
+		.close = &close_sequence,
+	},
+	{
+		.product = TX_ACTIVE,
+		.name = "TX",
+		.rdesc = tmgeneric_pc_rdesc_fixed,
+		.rdesc_size = sizeof(tmgeneric_pc_rdesc_fixed),
+		.range_min = 140,
+		.range_max = 900,
+		.params = tmgeneric_params,
+		.setup = &setup_sequence,
+		.open = &open_sequence,
+		.close = &close_sequence,
+	},
+	{
+		.product = TSXW_ACTIVE,
+		.name = "TS-XW",
+		.rdesc = tmgeneric_pc_rdesc_fixed,
+		.rdesc_size = sizeof(tmgeneric_pc_rdesc_fixed),
+		.range_min = 140,
+		.range_max = 1080,
+		.params = tmgeneric_params,
+		.setup = &setup_sequence,
+		.open = &open_sequence,
+		.close = &close_sequence,
+	},
+	{
+		.product = TMTS_PC_RACER_ID,
+		.name = "TS-PC",
+		.rdesc = tmgeneric_pc_rdesc_fixed,
+		.rdesc_size = sizeof(tmgeneric_pc_rdesc_fixed),
+		.range_min = 140,
+		.range_max = 1080,
+		.params = tmgeneric_params | PARAM_ALT_MODE,
+		.quirks = TMGENERIC_QUIRK_ALT_MODE_CTRL,
+		.setup = &setup_sequence,
+		.open = &open_sequence,
+		.close = &close_sequence,
+	},
+};
+
+/* tmff2->data points at t300rs, so the shared T300RS callbacks work as is */
+struct tmgeneric_device_entry {
+	struct t300rs_device_entry t300rs;
+	const struct tmgeneric_model *model;
+};
+
+static const struct tmgeneric_model *tmgeneric_find_model(u16 product)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(tmgeneric_models); ++i)
+		if (tmgeneric_models[i].product == product)
+			return &tmgeneric_models[i];
+
+	return NULL;
+}
+
+static const struct tmgeneric_model *tmgeneric_model(void *data)
+{
+	return container_of(data, struct tmgeneric_device_entry, t300rs)->model;
+}
+
+static int tmgeneric_wheel_destroy(void *data)
+{
+	struct t300rs_device_entry *t300rs = data;
+
+	if (!t300rs)
+		return -ENODEV;
+
+	kfree(t300rs->send_buffer);
+	kfree(container_of(t300rs, struct tmgeneric_device_entry, t300rs));
+	return 0;
+}
+
+static int tmgeneric_set_range(void *data, uint16_t value)
+{
+	struct t300rs_device_entry *t300rs = data;
+	const struct tmgeneric_model *model = tmgeneric_model(data);
+
+	if (value < model->range_min) {
+		hid_info(t300rs->hdev, "value %i too small, clamping to %i\n",
+				value, model->range_min);
+		value = model->range_min;
+	}
+
+	if (value > model->range_max) {
+		hid_info(t300rs->hdev, "value %i too large, clamping to %i\n",
+				value, model->range_max);
+		value = model->range_max;
+	}
+
+	return t300rs_set_range(data, value);
+}
+
+static int tmgeneric_send_sequence(struct t300rs_device_entry *t300rs,
+		const struct tmgeneric_sequence *sequence)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < sequence->count; ++i) {
+		memcpy(t300rs->send_buffer, sequence->commands[i],
+				sizeof(sequence->commands[i]));
+		if ((ret = t300rs_send_int(t300rs)))
+			return ret;
+	}
+
+	return 0;
+}
+
+static int tmgeneric_send_open(void *data)
+{
+	return tmgeneric_send_sequence(data, tmgeneric_model(data)->open);
+}
+
+static int tmgeneric_open(void *data, int open_mode)
+{
+	struct t300rs_device_entry *t300rs = data;
+
+	if (!t300rs)
+		return -ENODEV;
+
+	if (open_mode)
+		tmgeneric_send_open(t300rs);
+
+	return t300rs->open(t300rs->input_dev);
+}
+
+static int tmgeneric_send_close(void *data)
+{
+	return tmgeneric_send_sequence(data, tmgeneric_model(data)->close);
+}
+
+static int tmgeneric_close(void *data, int open_mode)
+{
+	struct t300rs_device_entry *t300rs = data;
+
+	if (!t300rs)
+		return -ENODEV;
+
+	if (open_mode)
+		tmgeneric_send_close(t300rs);
+
+	t300rs->close(t300rs->input_dev);
+	return 0;
+}
+
+static int tmgeneric_wheel_init(struct tmff2_device_entry *tmff2, int open_mode)
+{
+	const struct tmgeneric_model *model =
+		tmgeneric_find_model(tmff2->hdev->product);
+	struct tmgeneric_device_entry *wheel;
+	struct t300rs_device_entry *t300rs;
+	struct list_head *report_list;
+	ktime_t start;
+	int ret;
+
+	wheel = kzalloc(sizeof(*wheel), GFP_KERNEL);
+	if (!wheel) {
+		ret = -ENOMEM;
+		goto wheel_err;
+	}
+
+	wheel->model = model;
+	t300rs = &wheel->t300rs;
+	t300rs->hdev = tmff2->hdev;
+	t300rs->input_dev = tmff2->input_dev;
+	t300rs->usbdev = to_usb_device(tmff2->hdev->dev.parent->parent);
+	t300rs->settings = &tmff2->settings;
+	t300rs->buffer_length = TMGENERIC_BUFFER_LENGTH;
+
+	t300rs->send_buffer = kzalloc(t300rs->buffer_length, GFP_KERNEL);
+	if (!t300rs->send_buffer) {
+		ret = -ENOMEM;
+		goto send_err;
+	}
+
+	report_list = &t300rs->hdev->report_enum[HID_OUTPUT_REPORT].report_list;
+	t300rs->report = list_entry(report_list->next, struct hid_report, list);
+	t300rs->ff_field = t300rs->report->field[0];
+
+	t300rs->open = t300rs->input_dev->open;
+	t300rs->close = t300rs->input_dev->close;
+
+	start = ktime_get();
+	ret = t300rs_send_setup(t300rs, model->setup->packets,
+			model->setup->sizes, model->setup->count);
+	tmff2_boot_mark(tmff2, TMFF2_BOOT_SETUP, start, ktime_get());
+	if (ret)
+		goto interrupt_err;
+
+	/* everything went OK */
+	tmff2->data = t300rs;
+	tmff2->params = model->params;
+	tmff2->max_effects = TMGENERIC_MAX_EFFECTS;
+	memcpy(tmff2->supported_effects, tmgeneric_effects,
+			sizeof(tmgeneric_effects));
+
+	if (!open_mode)
+		tmgeneric_send_open(t300rs);
+
+	hid_info(t300rs->hdev, "force feedback for %s\n", model->name);
+	return 0;
+
+interrupt_err:
+	kfree(t300rs->send_buffer);
+send_err:
+	kfree(wheel);
+wheel_err:
+	hid_err(tmff2->hdev, "failed initializing %s\n", model->name);
+	return ret;
+}
+
+static __u8 *tmgeneric_wheel_fixup(struct hid_device *hdev, __u8 *rdesc,
+		unsigned int *rsize)
+{
+	const struct tmgeneric_model *model = tmgeneric_find_model(hdev->product);
+
+	*rsize = model->rdesc_size;
+	return model->rdesc;
+}
+
+static ssize_t tmgeneric_alt_mode_store(void *data, const char *buf,
+		size_t count)
+{
+	struct t300rs_device_entry *t300rs = data;
+	if (!t300rs)
+		return -ENODEV;
+
+	/* blindly trusting that this works for now */
+	usb_control_msg(t300rs->usbdev,
+			usb_sndctrlpipe(t300rs->usbdev, 0),
+			83, 0x41, 0xb, 0, 0, 0,
+			USB_CTRL_SET_TIMEOUT
+		       );
+
+	return count;
+}
+
+int tmgeneric_populate_api(struct tmff2_device_entry *tmff2)
+{
+	const struct tmgeneric_model *model =
+		tmgeneric_find_model(tmff2->hdev->product);
+
+	if (!model)
+		return -ENODEV;
+
+	/* effect commands are dispatched directly for the T300RS family */
+	tmff2->family = TMFF2_FAMILY_T300RS;
+
+	tmff2->set_gain = t300rs_set_gain;
+	tmff2->set_autocenter = t300rs_set_autocenter;
+	tmff2->set_range = tmgeneric_set_range;
+	tmff2->range_min = model->range_min;
+	tmff2->range_max = model->range_max;
+	tmff2->wheel_fixup = tmgeneric_wheel_fixup;
+
+	tmff2->open = tmgeneric_open;
+	tmff2->close = tmgeneric_close;
+	tmff2->send_open = tmgeneric_send_open;
+	tmff2->send_close = tmgeneric_send_close;
+	tmff2->check_raw = t300rs_check_raw;
+	tmff2->send_level = t300rs_send_level;
+	tmff2->send_raw = t300rs_send_raw;
+
+	if (model->quirks & TMGENERIC_QUIRK_ALT_MODE_CTRL)
+		tmff2->alt_mode_store = tmgeneric_alt_mode_store;
+
+	tmff2->wheel_init = tmgeneric_wheel_init;
+	tmff2->wheel_destroy = tmgeneric_wheel_destroy;
+
+	return 0;
+}
@@ -71,7 +71,7 @@ struct __packed t300rs_packet_timing {
 	uint16_t end_marker;
 };
 
-struct usb_ctrlrequest t300rs_fw_request = {
+static const struct usb_ctrlrequest t300rs_fw_request = {
 	.bRequestType = 0xc1,
 	.bRequest = 86,
 	.wValue = 0,
@@ -354,28 +354,36 @@ static int16_t t300rs_calculate_constant_level(int16_t level, uint16_t direction
 	return level;
 }
 
-static void t300rs_calculate_periodic_values(struct ff_effect *effect)
+static void t300rs_calculate_periodic_values(struct tmff2_effect_params *params,
+		const struct ff_effect *effect)
 {
-	struct ff_periodic_effect *periodic = &effect->u.periodic;
-	int16_t headroom;
+	const struct ff_periodic_effect *periodic = &effect->u.periodic;
+	int16_t magnitude, headroom;
+	uint16_t phase = periodic->phase;
 
-	periodic->magnitude = (periodic->magnitude * fixp_sin16(effect->direction * 360 / 0x10000)) / 0x7fff;
+	magnitude = (periodic->magnitude * fixp_sin16(effect->direction * 360 / 0x10000)) / 0x7fff;
 
-	if (periodic->magnitude < 0){
+	if (magnitude < 0){
 		/* the wheel handles positive magnitudes only */
-		periodic->magnitude = -periodic->magnitude;
+		magnitude = -magnitude;
 
 		/* to give the expected result 180 deg is added to the phase */
-		periodic->phase = (periodic->phase + (0x10000 / 2)) % 0x10000;
+		phase = (phase + (0x10000 / 2)) % 0x10000;
 	}
 
+	params->u.periodic.magnitude = magnitude;
+
 	/* the interval [0; 32677[ is used by the wheel for the [0; 360[ degree phase shift */
-	periodic->phase = periodic->phase * 32677 / 0x10000;
+	params->u.periodic.phase = phase * 32677 / 0x10000;
 
-	headroom = 0x7fff - periodic->magnitude;
+	headroom = 0x7fff - magnitude;
 	/* magnitude + offset cannot be outside the valid magnitude range, */
 	/* otherwise the wheel behaves incorrectly */
-	periodic->offset = clamp(periodic->offset, -headroom, headroom);
+	params->u.periodic.offset = clamp(periodic->offset, -headroom, headroom);
+
+	params->u.periodic.period = periodic->period;
+	params->u.periodic.waveform = periodic->waveform - 0x57;
+	params->u.periodic.envelope = periodic->envelope;
 }
 
 static uint16_t t300rs_condition_max_saturation(uint16_t effect_type)
@@ -394,20 +402,21 @@ static uint8_t t300rs_condition_effect_type(uint16_t effect_type)
 	return 0x07;
 }
 
-static int16_t t300rs_calculate_coefficient(int16_t coeff, uint16_t effect_type)
+static int16_t t300rs_calculate_coefficient(struct t300rs_device_entry *t300rs,
+		int16_t coeff, uint16_t effect_type)
 {
 	uint8_t input_level;
 
 	switch (effect_type)
 	{
 	case FF_SPRING:
-		input_level = spring_level;
+		input_level = t300rs->settings->spring_level;
 		break;
 	case FF_DAMPER:
-		input_level = damper_level;
+		input_level = t300rs->settings->damper_level;
 		break;
 	case FF_FRICTION:
-		input_level = friction_level;
+		input_level = t300rs->settings->friction_level;
 		break;
 	default:
 		input_level = 100;
@@ -436,22 +445,100 @@ static void t300rs_calculate_deadband(int16_t *out_rband, int16_t *out_lband,
 	*out_lband = clamp(offset - (deadband / 2), -0x7fff, 0x7fff);
 }
 
-static void t300rs_calculate_ramp_parameters(uint16_t *out_slope,
-		int16_t *out_center,
-		uint8_t *out_invert,
-		struct ff_effect *effect)
+static void t300rs_calculate_condition_values(struct t300rs_device_entry *t300rs,
+		struct tmff2_effect_params *params, const struct ff_effect *effect)
 {
-	struct ff_ramp_effect *ramp = &effect->u.ramp;
+	/* we only care about the first axis */
+	const struct ff_condition_effect *cond = &effect->u.condition[0];
+
+	params->u.condition.right_coeff =
+		t300rs_calculate_coefficient(t300rs, cond->right_coeff, effect->type);
+	params->u.condition.left_coeff =
+		t300rs_calculate_coefficient(t300rs, cond->left_coeff, effect->type);
+
+	t300rs_calculate_deadband(&params->u.condition.right_deadband,
+			&params->u.condition.left_deadband,
+			cond->deadband, cond->center);
+
+	params->u.condition.right_saturation =
+		t300rs_calculate_saturation(cond->right_saturation, effect->type);
+	params->u.condition.left_saturation =
+		t300rs_calculate_saturation(cond->left_saturation, effect->type);
+}
+
+static void t300rs_calculate_ramp_parameters(struct tmff2_effect_params *params,
+		const struct ff_effect *effect)
+{
+	const struct ff_ramp_effect *ramp = &effect->u.ramp;
 
 	int16_t start_level, end_level;
 
 	start_level = (ramp->start_level * fixp_sin16(effect->direction * 360 / 0x10000)) / 0x7fff;
 	end_level = (ramp->end_level * fixp_sin16(effect->direction * 360 / 0x10000)) / 0x7fff;
 
-	*out_slope = abs(start_level - end_level) / 2;
-	*out_center = (start_level + end_level) / 2;
+	params->u.ramp.slope = abs(start_level - end_level) / 2;
+	params->u.ramp.center = (start_level + end_level) / 2;
 
-	*out_invert = (start_level < end_level) ? 0x04 : 0x05;
+	params->u.ramp.invert = (start_level < end_level) ? 0x04 : 0x05;
+	params->u.ramp.envelope = ramp->envelope;
+}
+
+int t300rs_normalise_effect(void *data, const struct ff_effect *effect,
+		struct tmff2_effect_params *params)
+{
+	struct t300rs_device_entry *t300rs = data;
+
+	/* zero everything so that two records describing the same effect
+	 * compare equal with memcmp, padding included */
+	memset(params, 0, sizeof(*params));
+
+	params->type = effect->type;
+	params->duration = t300rs_calculate_length(effect->replay.length);
+	params->delay = effect->replay.delay;
+
+	switch (effect->type) {
+		case FF_CONSTANT:
+			params->u.constant.level = t300rs_calculate_constant_level(
+					effect->u.constant.level, effect->direction);
+			params->u.constant.envelope = effect->u.constant.envelope;
+			break;
+		case FF_RAMP:
+			t300rs_calculate_ramp_parameters(params, effect);
+			break;
+		case FF_SPRING:
+		case FF_DAMPER:
+		case FF_FRICTION:
+		case FF_INERTIA:
+			t300rs_calculate_condition_values(t300rs, params, effect);
+			break;
+		case FF_PERIODIC:
+			t300rs_calculate_periodic_values(params, effect);
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* the same report through hid_hw_output_report, which HID-BPF programs can
+ * hook into with hid_bpf_ops.hid_hw_output_report on 6.11 and later. Unlike
+ * hid_hw_request this waits for the transfer to finish. */
+static int t300rs_send_output(struct t300rs_device_entry *t300rs)
+{
+	u8 *buf;
+	int ret;
+
+	buf = hid_alloc_report_buf(t300rs->report, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	hid_output_report(t300rs->report, buf);
+	ret = hid_hw_output_report(t300rs->hdev, buf,
+			hid_report_len(t300rs->report));
+	kfree(buf);
+
+	return ret < 0 ? ret : 0;
 }
 
 int t300rs_send_buf(struct t300rs_device_entry *t300rs, u8 *send_buffer, size_t len)
@@ -469,15 +556,92 @@ int t300rs_send_buf(struct t300rs_device_entry *t300rs, u8 *send_buffer, size_t
 	for (i = len; i < t300rs->buffer_length; ++i)
 		t300rs->ff_field->value[i] = 0;
 
+	switch (tmff2_inject_fault(t300rs->hdev)) {
+		case TMFF2_FAULT_DROP:
+			return 0;
+		case TMFF2_FAULT_ERROR:
+			return -EIO;
+		default:
+			break;
+	}
+
+	if (READ_ONCE(hid_bpf_output))
+		return t300rs_send_output(t300rs);
+
 	hid_hw_request(t300rs->hdev, t300rs->report, HID_REQ_SET_REPORT);
 	return 0;
 }
 
+/* command packing, with pack_commands set. Short commands are collected in
+ * pack_buffer and go out back to back in one report, zero padded like any
+ * other, when it's full, before any other command and at the end of the
+ * tick. Nothing the wheel reports tells whether its firmware takes more than
+ * one command per report, and a firmware that drops the commands after the
+ * first one doesn't fail the send. Only send errors, which hid_hw_request
+ * never reports, turn packing off for the device and have the wheel
+ * resynced. */
+static void t300rs_send_pack(struct t300rs_device_entry *t300rs)
+{
+	u8 len = t300rs->pack_len;
+
+	if (!len)
+		return;
+
+	t300rs->pack_len = 0;
+	if (!t300rs_send_buf(t300rs, t300rs->pack_buffer, len))
+		return;
+
+	if (!t300rs->pack_failed)
+		hid_warn(t300rs->hdev,
+				"packed report failed, sending commands one by one\n");
+
+	t300rs->pack_failed = true;
+	t300rs->pack_lost = true;
+}
+
+/* end of the tick, returns an error if commands were lost in a packed report
+ * since the last call */
+int t300rs_flush(void *data)
+{
+	struct t300rs_device_entry *t300rs = data;
+	bool lost;
+
+	t300rs_send_pack(t300rs);
+
+	lost = t300rs->pack_lost;
+	t300rs->pack_lost = false;
+	return lost ? -EIO : 0;
+}
+
 int t300rs_send_int(struct t300rs_device_entry *t300rs)
 {
-	t300rs_send_buf(t300rs, t300rs->send_buffer, t300rs->buffer_length);
+	int ret;
+
+	/* keep the order commands were issued in */
+	t300rs_send_pack(t300rs);
+
+	ret = t300rs_send_buf(t300rs, t300rs->send_buffer, t300rs->buffer_length);
 	memset(t300rs->send_buffer, 0, t300rs->buffer_length);
 
+	return ret;
+}
+
+/* the command in send_buffer is len bytes long and can share a report */
+static int t300rs_send_short(struct t300rs_device_entry *t300rs, size_t len)
+{
+	if (!READ_ONCE(pack_commands) || t300rs->pack_failed)
+		return t300rs_send_int(t300rs);
+
+	if (t300rs->pack_len + len > t300rs->buffer_length) {
+		t300rs_send_pack(t300rs);
+		if (t300rs->pack_failed)
+			return t300rs_send_int(t300rs);
+	}
+
+	memcpy(t300rs->pack_buffer + t300rs->pack_len, t300rs->send_buffer, len);
+	t300rs->pack_len += len;
+	memset(t300rs->send_buffer, 0, len);
+
 	return 0;
 }
 
@@ -488,7 +652,7 @@ static void t300rs_fill_header(struct t300rs_packet_header *packet_header,
 	packet_header->code = code;
 }
 
-int t300rs_play_effect(void *data, const struct tmff2_effect_state *state)
+int t300rs_play_effect(void *data, int id, unsigned long count)
 {
 	struct t300rs_device_entry *t300rs = data;
 	struct __packed t300rs_packet_play {
@@ -500,22 +664,22 @@ int t300rs_play_effect(void *data, const struct tmff2_effect_state *state)
 	int ret;
 
 
-	t300rs_fill_header(&play_packet->header, state->effect.id, 0x89);
+	t300rs_fill_header(&play_packet->header, id, 0x89);
 	play_packet->code = 0x41;
 
-	if (state->count == 0 || state->count >= 65535)
+	if (count == 0 || count >= 65535)
 		play_packet->count = 0;
 	else
-		play_packet->count = cpu_to_le16(state->count);
+		play_packet->count = cpu_to_le16(count);
 
-	ret = t300rs_send_int(t300rs);
+	ret = t300rs_send_short(t300rs, sizeof(*play_packet));
 	if (ret)
 		hid_err(t300rs->hdev, "failed starting effect play\n");
 
 	return ret;
 }
 
-int t300rs_stop_effect(void *data, const struct tmff2_effect_state *state)
+int t300rs_stop_effect(void *data, int id)
 {
 	struct t300rs_device_entry *t300rs = data;
 	struct __packed t300rs_packet_stop {
@@ -526,9 +690,9 @@ int t300rs_stop_effect(void *data, const struct tmff2_effect_state *state)
 	int ret;
 
 
-	t300rs_fill_header(&stop_packet->header, state->effect.id, 0x89);
+	t300rs_fill_header(&stop_packet->header, id, 0x89);
 
-	ret = t300rs_send_int(t300rs);
+	ret = t300rs_send_short(t300rs, sizeof(*stop_packet));
 	if (ret)
 		hid_err(t300rs->hdev, "failed stopping effect play\n");
 
@@ -536,7 +700,7 @@ int t300rs_stop_effect(void *data, const struct tmff2_effect_state *state)
 }
 
 static void t300rs_fill_envelope(struct t300rs_packet_envelope *packet_envelope,
-		struct ff_envelope *envelope)
+		const struct ff_envelope *envelope)
 {
 	// Note: Minimal length limitations are not enforced,
 	// as testing shows that the wheel can handle lower values well
@@ -546,15 +710,6 @@ static void t300rs_fill_envelope(struct t300rs_packet_envelope *packet_envelope,
 	packet_envelope->fade_level = cpu_to_le16(envelope->fade_level);
 }
 
-static int t300rs_is_envelope_changed(struct ff_envelope *new,
-	struct ff_envelope *old)
-{
-	return new->attack_length != old->attack_length
-			|| new->attack_level != old->attack_level
-			|| new->fade_length != old->fade_length
-			|| new->fade_level != old->fade_level;
-}
-
 static void t300rs_fill_timing(struct t300rs_packet_timing *packet_timing,
 		uint16_t duration, uint16_t offset){
 	packet_timing->start_marker = 0x4f;
@@ -565,13 +720,9 @@ static void t300rs_fill_timing(struct t300rs_packet_timing *packet_timing,
 	packet_timing->end_marker = 0xffff;
 }
 
-static int t300rs_update_constant(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_update_constant(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	struct ff_effect old = state->old;
-	struct ff_constant_effect constant = effect.u.constant;
-	struct ff_constant_effect constant_old = old.u.constant;
 	struct __packed t300rs_packet_mod_constant {
 		struct t300rs_packet_header header;
 		uint16_t magnitude;
@@ -582,31 +733,18 @@ static int t300rs_update_constant(struct t300rs_device_entry *t300rs,
 		uint16_t offset;
 	} *packet_mod_constant = (struct t300rs_packet_mod_constant *)t300rs->send_buffer;
 
-	int ret = 0;
-	int16_t level, old_level;
-	uint16_t length, old_length;
-
-	level = t300rs_calculate_constant_level(constant.level, effect.direction);
-	old_level = t300rs_calculate_constant_level(constant_old.level, old.direction);
-
-	length = t300rs_calculate_length(effect.replay.length);
-	old_length = t300rs_calculate_length(old.replay.length);
-
-	if (!t300rs_is_envelope_changed(&constant.envelope, &constant_old.envelope)
-			&& level == old_level
-			&& length == old_length
-			&& effect.replay.delay == old.replay.delay)
-		return ret;
+	int ret;
 
-	t300rs_fill_header(&packet_mod_constant->header, effect.id, 0x6a);
-	packet_mod_constant->magnitude = cpu_to_le16(level);
+	t300rs_fill_header(&packet_mod_constant->header, id, 0x6a);
+	packet_mod_constant->magnitude = cpu_to_le16(effect->u.constant.level);
 
-	t300rs_fill_envelope(&packet_mod_constant->envelope, &constant.envelope);
+	t300rs_fill_envelope(&packet_mod_constant->envelope,
+			&effect->u.constant.envelope);
 
 	packet_mod_constant->effect_type = 0x00;
 	packet_mod_constant->update_type = 0x45;
-	packet_mod_constant->duration = cpu_to_le16(length);
-	packet_mod_constant->offset = cpu_to_le16(effect.replay.delay);
+	packet_mod_constant->duration = cpu_to_le16(effect->duration);
+	packet_mod_constant->offset = cpu_to_le16(effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -615,13 +753,26 @@ static int t300rs_update_constant(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_update_ramp(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+/* magnitude only modify, for streamed torque. level is in ff-core's range
+ * for an effect pointing east. */
+int t300rs_send_level(void *data, int id, int16_t level)
+{
+	struct t300rs_device_entry *t300rs = data;
+	struct __packed t300rs_packet_mod_level {
+		struct t300rs_packet_header header;
+		uint16_t magnitude;
+	} *packet_mod_level = (struct t300rs_packet_mod_level *)t300rs->send_buffer;
+
+	t300rs_fill_header(&packet_mod_level->header, id, 0x0a);
+	packet_mod_level->magnitude =
+		cpu_to_le16(t300rs_calculate_constant_level(level, 0x4000));
+
+	return t300rs_send_short(t300rs, sizeof(*packet_mod_level));
+}
+
+static int t300rs_update_ramp(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	struct ff_effect old = state->old;
-	struct ff_ramp_effect ramp = effect.u.ramp;
-	struct ff_ramp_effect ramp_old = old.u.ramp;
 	struct __packed t300rs_packet_mod_ramp {
 		struct t300rs_packet_header header;
 		uint8_t type;
@@ -635,38 +786,20 @@ static int t300rs_update_ramp(struct t300rs_device_entry *t300rs,
 		uint16_t offset;
 	} *packet_mod_ramp = (struct t300rs_packet_mod_ramp *)t300rs->send_buffer;
 
-	int ret = 0;
-
-	uint8_t invert, old_invert;
-	uint16_t slope, old_slope, length, old_length;
-	int16_t center, old_center;
-
-	t300rs_calculate_ramp_parameters(&slope, &center, &invert, &effect);
-	t300rs_calculate_ramp_parameters(&old_slope, &old_center, &old_invert, &old);
-
-	length = t300rs_calculate_length(effect.replay.length);
-	old_length = t300rs_calculate_length(old.replay.length);
-
-	if (!t300rs_is_envelope_changed(&ramp.envelope, &ramp_old.envelope)
-			&& slope == old_slope
-			&& center == old_center
-			&& invert == old_invert
-			&& length == old_length
-			&& effect.replay.delay == old.replay.delay)
-		return ret;
+	int ret;
 
-	t300rs_fill_header(&packet_mod_ramp->header, effect.id, 0x6e);
+	t300rs_fill_header(&packet_mod_ramp->header, id, 0x6e);
 	packet_mod_ramp->type = 0x0b;
-	packet_mod_ramp->slope = cpu_to_le16(slope);
-	packet_mod_ramp->center = cpu_to_le16(center);
-	packet_mod_ramp->length = cpu_to_le16(length);
+	packet_mod_ramp->slope = cpu_to_le16(effect->u.ramp.slope);
+	packet_mod_ramp->center = cpu_to_le16(effect->u.ramp.center);
+	packet_mod_ramp->length = cpu_to_le16(effect->duration);
 
-	t300rs_fill_envelope(&packet_mod_ramp->envelope, &ramp.envelope);
+	t300rs_fill_envelope(&packet_mod_ramp->envelope, &effect->u.ramp.envelope);
 
-	packet_mod_ramp->effect_type = invert;
+	packet_mod_ramp->effect_type = effect->u.ramp.invert;
 	packet_mod_ramp->update_type = 0x45;
 	packet_mod_ramp->length2 = packet_mod_ramp->length;
-	packet_mod_ramp->offset = cpu_to_le16(effect.replay.delay);
+	packet_mod_ramp->offset = cpu_to_le16(effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -675,13 +808,9 @@ static int t300rs_update_ramp(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_update_condition(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_update_condition(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	struct ff_effect old = state->old;
-	struct ff_condition_effect cond = effect.u.condition[0];
-	struct ff_condition_effect cond_old = old.u.condition[0];
 	struct __packed t300rs_packet_mod_condition
 	{
 		struct t300rs_packet_header header;
@@ -697,54 +826,20 @@ static int t300rs_update_condition(struct t300rs_device_entry *t300rs,
 		uint16_t delay;
 	} *packet_mod_condition = (struct t300rs_packet_mod_condition *)t300rs->send_buffer;
 
-	int ret = 0;
-	uint16_t duration, duration_old;
-	uint16_t right_sat, right_sat_old, left_sat, left_sat_old;
-	uint16_t right_coeff, right_coeff_old, left_coeff, left_coeff_old;
-	int16_t right_deadband, right_deadband_old, left_deadband, left_deadband_old;
-
-	right_coeff = t300rs_calculate_coefficient(cond.right_coeff, effect.type);
-	right_coeff_old = t300rs_calculate_coefficient(cond_old.right_coeff, old.type);
-
-	left_coeff = t300rs_calculate_coefficient(cond.left_coeff, effect.type);
-	left_coeff_old = t300rs_calculate_coefficient(cond_old.left_coeff, old.type);
-
-	t300rs_calculate_deadband(&right_deadband, &left_deadband,
-		cond.deadband, cond.center);
-	t300rs_calculate_deadband(&right_deadband_old, &left_deadband_old,
-		cond_old.deadband, cond_old.center);
-
-	right_sat = t300rs_calculate_saturation(cond.right_saturation, effect.type);
-	right_sat_old = t300rs_calculate_saturation(cond_old.right_saturation, old.type);
-
-	left_sat = t300rs_calculate_saturation(cond.left_saturation, effect.type);
-	left_sat_old = t300rs_calculate_saturation(cond_old.left_saturation, old.type);
-
-	duration = t300rs_calculate_length(effect.replay.length);
-	duration_old = t300rs_calculate_length(old.replay.length);
-
-	if (right_coeff == right_coeff_old
-			&& left_coeff == left_coeff_old
-			&& right_deadband == right_deadband_old
-			&& left_deadband == left_deadband_old
-			&& right_sat == right_sat_old
-			&& left_sat == left_sat_old
-			&& duration == duration_old
-			&& effect.replay.delay == old.replay.delay)
-		return ret;
+	int ret;
 
-	packet_mod_condition->right_coeff = cpu_to_le16(right_coeff);
-	packet_mod_condition->left_coeff = cpu_to_le16(left_coeff);
-	packet_mod_condition->right_deadband = cpu_to_le16(right_deadband);
-	packet_mod_condition->left_deadband = cpu_to_le16(left_deadband);
-	packet_mod_condition->right_saturation = cpu_to_le16(right_sat);
-	packet_mod_condition->left_saturation = cpu_to_le16(left_sat);
+	packet_mod_condition->right_coeff = cpu_to_le16(effect->u.condition.right_coeff);
+	packet_mod_condition->left_coeff = cpu_to_le16(effect->u.condition.left_coeff);
+	packet_mod_condition->right_deadband = cpu_to_le16(effect->u.condition.right_deadband);
+	packet_mod_condition->left_deadband = cpu_to_le16(effect->u.condition.left_deadband);
+	packet_mod_condition->right_saturation = cpu_to_le16(effect->u.condition.right_saturation);
+	packet_mod_condition->left_saturation = cpu_to_le16(effect->u.condition.left_saturation);
 	packet_mod_condition->effect_type = 0x06;
 	packet_mod_condition->update_type = 0x45;
-	packet_mod_condition->duration = cpu_to_le16(duration);
-	packet_mod_condition->delay = cpu_to_le16(effect.replay.delay);
+	packet_mod_condition->duration = cpu_to_le16(effect->duration);
+	packet_mod_condition->delay = cpu_to_le16(effect->delay);
 
-	t300rs_fill_header(&packet_mod_condition->header, effect.id, 0x4c);
+	t300rs_fill_header(&packet_mod_condition->header, id, 0x4c);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -753,11 +848,9 @@ static int t300rs_update_condition(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_update_periodic(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_update_periodic(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	struct ff_effect old = state->old;
 	struct __packed t300rs_packet_mod_periodic {
 		struct t300rs_packet_header header;
 		uint8_t type;
@@ -772,41 +865,22 @@ static int t300rs_update_periodic(struct t300rs_device_entry *t300rs,
 		uint16_t play_offset;
 	} *packet_mod_periodic = (struct t300rs_packet_mod_periodic *)t300rs->send_buffer;
 
-	struct ff_periodic_effect periodic, periodic_old;
-	int ret = 0;
-	uint16_t length, old_length;
-
-	t300rs_calculate_periodic_values(&effect);
-	periodic = effect.u.periodic;
-
-	t300rs_calculate_periodic_values(&old);
-	periodic_old = old.u.periodic;
-
-	length = t300rs_calculate_length(effect.replay.length);
-	old_length = t300rs_calculate_length(old.replay.length);
-
-	if (!t300rs_is_envelope_changed(&periodic.envelope, &periodic_old.envelope)
-			&& periodic.magnitude == periodic_old.magnitude
-			&& periodic.offset == periodic_old.offset
-			&& periodic.phase == periodic_old.phase
-			&& periodic.period == periodic_old.period
-			&& length == old_length
-			&& effect.replay.delay == old.replay.delay)
-		return ret;
+	int ret;
 
-	t300rs_fill_header(&packet_mod_periodic->header, effect.id, 0x6e);
+	t300rs_fill_header(&packet_mod_periodic->header, id, 0x6e);
 	packet_mod_periodic->type = 0x0f;
-	packet_mod_periodic->magnitude = cpu_to_le16(periodic.magnitude);
-	packet_mod_periodic->offset = cpu_to_le16(periodic.offset);
-	packet_mod_periodic->phase = cpu_to_le16(periodic.phase);
-	packet_mod_periodic->period = cpu_to_le16(periodic.period);
+	packet_mod_periodic->magnitude = cpu_to_le16(effect->u.periodic.magnitude);
+	packet_mod_periodic->offset = cpu_to_le16(effect->u.periodic.offset);
+	packet_mod_periodic->phase = cpu_to_le16(effect->u.periodic.phase);
+	packet_mod_periodic->period = cpu_to_le16(effect->u.periodic.period);
 
-	t300rs_fill_envelope(&packet_mod_periodic->envelope, &periodic.envelope);
+	t300rs_fill_envelope(&packet_mod_periodic->envelope,
+			&effect->u.periodic.envelope);
 
-	packet_mod_periodic->effect_type = periodic.waveform - 0x57;
+	packet_mod_periodic->effect_type = effect->u.periodic.waveform;
 	packet_mod_periodic->update_type = 0x45;
-	packet_mod_periodic->duration = cpu_to_le16(length);
-	packet_mod_periodic->play_offset = cpu_to_le16(effect.replay.delay);
+	packet_mod_periodic->duration = cpu_to_le16(effect->duration);
+	packet_mod_periodic->play_offset = cpu_to_le16(effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -815,11 +889,9 @@ static int t300rs_update_periodic(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_upload_constant(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_upload_constant(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	struct ff_constant_effect constant = state->effect.u.constant;
 	struct __packed t300rs_packet_constant {
 		struct t300rs_packet_header header;
 		uint16_t level;
@@ -828,22 +900,14 @@ static int t300rs_upload_constant(struct t300rs_device_entry *t300rs,
 		struct t300rs_packet_timing timing;
 	} *packet_constant = (struct t300rs_packet_constant *)t300rs->send_buffer;
 
-	int16_t level;
-	uint16_t duration, offset;
-
 	int ret;
 
-	level = t300rs_calculate_constant_level(constant.level, effect.direction);
-	duration = t300rs_calculate_length(effect.replay.length);
-
-	offset = effect.replay.delay;
-
-	t300rs_fill_header(&packet_constant->header, effect.id, 0x6a);
+	t300rs_fill_header(&packet_constant->header, id, 0x6a);
 
-	packet_constant->level = cpu_to_le16(level);
+	packet_constant->level = cpu_to_le16(effect->u.constant.level);
 
-	t300rs_fill_envelope(&packet_constant->envelope, &constant.envelope);
-	t300rs_fill_timing(&packet_constant->timing, duration, offset);
+	t300rs_fill_envelope(&packet_constant->envelope, &effect->u.constant.envelope);
+	t300rs_fill_timing(&packet_constant->timing, effect->duration, effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -852,11 +916,9 @@ static int t300rs_upload_constant(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_upload_ramp(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_upload_ramp(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	struct ff_ramp_effect ramp = state->effect.u.ramp;
 	struct __packed t300rs_packet_ramp {
 		struct t300rs_packet_header header;
 		uint16_t slope;
@@ -870,27 +932,19 @@ static int t300rs_upload_ramp(struct t300rs_device_entry *t300rs,
 	} *packet_ramp = (struct t300rs_packet_ramp *)t300rs->send_buffer;
 
 	int ret;
-	uint8_t invert;
-	uint16_t slope, offset, duration;
-	int16_t center;
 
-	t300rs_calculate_ramp_parameters(&slope, &center, &invert, &effect);
+	t300rs_fill_header(&packet_ramp->header, id, 0x6b);
 
-	duration = t300rs_calculate_length(effect.replay.length);
-	offset = effect.replay.delay;
-
-	t300rs_fill_header(&packet_ramp->header, effect.id, 0x6b);
-
-	packet_ramp->slope = cpu_to_le16(slope);
-	packet_ramp->center = cpu_to_le16(center);
-	packet_ramp->duration = cpu_to_le16(duration);
+	packet_ramp->slope = cpu_to_le16(effect->u.ramp.slope);
+	packet_ramp->center = cpu_to_le16(effect->u.ramp.center);
+	packet_ramp->duration = cpu_to_le16(effect->duration);
 
 	packet_ramp->marker = cpu_to_le16(0x8000);
 
-	t300rs_fill_envelope(&packet_ramp->envelope, &ramp.envelope);
+	t300rs_fill_envelope(&packet_ramp->envelope, &effect->u.ramp.envelope);
 
-	packet_ramp->invert = invert;
-	t300rs_fill_timing(&packet_ramp->timing, duration, offset);
+	packet_ramp->invert = effect->u.ramp.invert;
+	t300rs_fill_timing(&packet_ramp->timing, effect->duration, effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -899,12 +953,9 @@ static int t300rs_upload_ramp(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_upload_condition(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_upload_condition(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
-	/* we only care about the first axis */
-	struct ff_condition_effect cond = state->effect.u.condition[0];
 	struct __packed t300rs_packet_condition {
 		struct t300rs_packet_header header;
 		int16_t right_coeff;
@@ -921,41 +972,27 @@ static int t300rs_upload_condition(struct t300rs_device_entry *t300rs,
 	} *packet_condition = (struct t300rs_packet_condition *)t300rs->send_buffer;
 
 	int ret;
-	uint16_t duration, right_sat, left_sat, right_coeff, left_coeff, max_sat, offset;
-	int16_t right_deadband, left_deadband;
+	uint16_t max_sat;
 
-	right_coeff = t300rs_calculate_coefficient(cond.right_coeff, effect.type);
-	left_coeff = t300rs_calculate_coefficient(cond.left_coeff, effect.type);
+	t300rs_fill_header(&packet_condition->header, id, 0x64);
 
-	t300rs_calculate_deadband(&right_deadband, &left_deadband,
-		cond.deadband, cond.center);
-
-	right_sat = t300rs_calculate_saturation(cond.right_saturation, effect.type);
-	left_sat = t300rs_calculate_saturation(cond.left_saturation, effect.type);
-
-	duration = t300rs_calculate_length(effect.replay.length);
-
-	offset = effect.replay.delay;
-
-	t300rs_fill_header(&packet_condition->header, effect.id, 0x64);
-
-	packet_condition->right_coeff = cpu_to_le16(right_coeff);
-	packet_condition->left_coeff = cpu_to_le16(left_coeff);
-	packet_condition->right_deadband = cpu_to_le16(right_deadband);
-	packet_condition->left_deadband = cpu_to_le16(left_deadband);
-	packet_condition->right_saturation = cpu_to_le16(right_sat);
-	packet_condition->left_saturation = cpu_to_le16(left_sat);
+	packet_condition->right_coeff = cpu_to_le16(effect->u.condition.right_coeff);
+	packet_condition->left_coeff = cpu_to_le16(effect->u.condition.left_coeff);
+	packet_condition->right_deadband = cpu_to_le16(effect->u.condition.right_deadband);
+	packet_condition->left_deadband = cpu_to_le16(effect->u.condition.left_deadband);
+	packet_condition->right_saturation = cpu_to_le16(effect->u.condition.right_saturation);
+	packet_condition->left_saturation = cpu_to_le16(effect->u.condition.left_saturation);
 
 	memcpy(&packet_condition->hardcoded, condition_values,
 		ARRAY_SIZE(condition_values));
 
-	max_sat = t300rs_condition_max_saturation(effect.type);
+	max_sat = t300rs_condition_max_saturation(effect->type);
 	/* it seems that the maximum values do not affect the wheel. */
 	packet_condition->max_right_saturation = cpu_to_le16(max_sat);
 	packet_condition->max_left_saturation = cpu_to_le16(max_sat);
-	packet_condition->type = t300rs_condition_effect_type(effect.type);
+	packet_condition->type = t300rs_condition_effect_type(effect->type);
 
-	t300rs_fill_timing(&packet_condition->timing, duration, offset);
+	t300rs_fill_timing(&packet_condition->timing, effect->duration, effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -964,10 +1001,9 @@ static int t300rs_upload_condition(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-static int t300rs_upload_periodic(struct t300rs_device_entry *t300rs,
-		const struct tmff2_effect_state *state)
+static int t300rs_upload_periodic(struct t300rs_device_entry *t300rs, int id,
+		const struct tmff2_effect_params *effect)
 {
-	struct ff_effect effect = state->effect;
 	struct __packed t300rs_packet_periodic {
 		struct t300rs_packet_header header;
 		uint16_t magnitude;
@@ -980,34 +1016,22 @@ static int t300rs_upload_periodic(struct t300rs_device_entry *t300rs,
 		struct t300rs_packet_timing timing;
 	} *packet_periodic = (struct t300rs_packet_periodic *)t300rs->send_buffer;
 
-	struct ff_periodic_effect periodic;
 	int ret;
-	uint16_t duration, period, phase, offset, periodic_offset;
-	int16_t magnitude;
-
-	t300rs_calculate_periodic_values(&effect);
-	periodic = effect.u.periodic;
-	duration = t300rs_calculate_length(effect.replay.length);
-	offset = effect.replay.delay;
-	magnitude = periodic.magnitude;
-	period = periodic.period;
-	phase = periodic.phase;
-	periodic_offset = periodic.offset;
 
-	t300rs_fill_header(&packet_periodic->header, effect.id, 0x6b);
+	t300rs_fill_header(&packet_periodic->header, id, 0x6b);
 
-	packet_periodic->magnitude = cpu_to_le16(magnitude);
-	packet_periodic->periodic_offset = cpu_to_le16(periodic_offset);
-	packet_periodic->phase = cpu_to_le16(phase);
-	packet_periodic->period = cpu_to_le16(period);
+	packet_periodic->magnitude = cpu_to_le16(effect->u.periodic.magnitude);
+	packet_periodic->periodic_offset = cpu_to_le16(effect->u.periodic.offset);
+	packet_periodic->phase = cpu_to_le16(effect->u.periodic.phase);
+	packet_periodic->period = cpu_to_le16(effect->u.periodic.period);
 
 	packet_periodic->marker = cpu_to_le16(0x8000);
 
-	t300rs_fill_envelope(&packet_periodic->envelope, &periodic.envelope);
+	t300rs_fill_envelope(&packet_periodic->envelope, &effect->u.periodic.envelope);
 
-	packet_periodic->waveform = periodic.waveform - 0x57;
+	packet_periodic->waveform = effect->u.periodic.waveform;
 
-	t300rs_fill_timing(&packet_periodic->timing, duration, offset);
+	t300rs_fill_timing(&packet_periodic->timing, effect->duration, effect->delay);
 
 	ret = t300rs_send_int(t300rs);
 	if (ret)
@@ -1016,46 +1040,55 @@ static int t300rs_upload_periodic(struct t300rs_device_entry *t300rs,
 	return ret;
 }
 
-int t300rs_update_effect(void *data, const struct tmff2_effect_state *state)
+int t300rs_update_effect(void *data, int id,
+		const struct tmff2_effect_params *effect,
+		const struct tmff2_effect_params *old)
 {
 	struct t300rs_device_entry *t300rs = data;
-	switch (state->effect.type) {
+
+	/* records are normalised and zero padded, nothing to do if the wheel
+	 * would end up with exactly the same parameters */
+	if (!memcmp(effect, old, sizeof(*effect)))
+		return 0;
+
+	switch (effect->type) {
 		case FF_CONSTANT:
-			return t300rs_update_constant(t300rs, state);
+			return t300rs_update_constant(t300rs, id, effect);
 		case FF_RAMP:
-			return t300rs_update_ramp(t300rs, state);
+			return t300rs_update_ramp(t300rs, id, effect);
 		case FF_SPRING:
 		case FF_DAMPER:
 		case FF_FRICTION:
 		case FF_INERTIA:
-			return t300rs_update_condition(t300rs, state);
+			return t300rs_update_condition(t300rs, id, effect);
 		case FF_PERIODIC:
-			return t300rs_update_periodic(t300rs, state);
+			return t300rs_update_periodic(t300rs, id, effect);
 		default:
 			hid_err(t300rs->hdev, "invalid effect type: %x",
-					state->effect.type);
+					effect->type);
 			return -1;
 	}
 }
 
-int t300rs_upload_effect(void *data, const struct tmff2_effect_state *state)
+int t300rs_upload_effect(void *data, int id,
+		const struct tmff2_effect_params *effect)
 {
 	struct t300rs_device_entry *t300rs = data;
-	switch (state->effect.type) {
+	switch (effect->type) {
 		case FF_CONSTANT:
-			return t300rs_upload_constant(t300rs, state);
+			return t300rs_upload_constant(t300rs, id, effect);
 		case FF_RAMP:
-			return t300rs_upload_ramp(t300rs, state);
+			return t300rs_upload_ramp(t300rs, id, effect);
 		case FF_SPRING:
 		case FF_DAMPER:
 		case FF_FRICTION:
 		case FF_INERTIA:
-			return t300rs_upload_condition(t300rs, state);
+			return t300rs_upload_condition(t300rs, id, effect);
 		case FF_PERIODIC:
-			return t300rs_upload_periodic(t300rs, state);
+			return t300rs_upload_periodic(t300rs, id, effect);
 		default:
 			hid_err(t300rs->hdev, "invalid effect type: %x",
-					state->effect.type);
+					effect->type);
 			return -1;
 	}
 }
@@ -1223,10 +1256,6 @@ int t300rs_set_gain(void *data, uint16_t gain)
 int t300rs_set_range(void *data, uint16_t value)
 {
 	struct t300rs_device_entry *t300rs = data;
-	/* it's important that we don't use t300rs->send_buffer, as range can be
-	 * set from outside of the FFB environment, and we don't want to
-	 * accidentally overwrite any data. */
-	u8 *send_buffer = kzalloc(t300rs->buffer_length, GFP_KERNEL);
 	uint16_t scaled_value;
 	int ret;
 
@@ -1240,30 +1269,25 @@ int t300rs_set_range(void *data, uint16_t value)
 		value = 1080;
 	}
 
-	if (!send_buffer) {
-		ret = -EINVAL;
-		hid_err(t300rs->hdev, "could not allocate send_buffer\n");
-		goto err;
-	}
-
+	/* only sent from the work handler, so send_buffer is ours and whatever
+	 * was packed before goes out first */
 	scaled_value = value * 0x3c;
-	send_buffer[0] = 0x08;
-	send_buffer[1] = 0x11;
-	send_buffer[2] = scaled_value & 0xff;
-	send_buffer[3] = scaled_value >> 8;
+	t300rs->send_buffer[0] = 0x08;
+	t300rs->send_buffer[1] = 0x11;
+	t300rs->send_buffer[2] = scaled_value & 0xff;
+	t300rs->send_buffer[3] = scaled_value >> 8;
 
-	if ((ret = t300rs_send_buf(t300rs, send_buffer, t300rs->buffer_length)))
+	if ((ret = t300rs_send_int(t300rs))) {
 		hid_warn(t300rs->hdev, "failed setting range\n");
+		return ret;
+	}
 
-	/* since everythin went OK, update the current range */
-	range = value;
-err:
-	kfree(send_buffer);
-	return ret;
+	return value;
 }
 
-static int t300rs_send_open(struct t300rs_device_entry *t300rs)
+static int t300rs_send_open(void *data)
 {
+	struct t300rs_device_entry *t300rs = data;
 	struct __packed t300rs_packet_open {
 		struct t300rs_setup_header header;
 	} *open_packet;
@@ -1275,8 +1299,9 @@ static int t300rs_send_open(struct t300rs_device_entry *t300rs)
 	return t300rs_send_int(t300rs);
 }
 
-static int t300rs_send_close(struct t300rs_device_entry *t300rs)
+static int t300rs_send_close(void *data)
 {
+	struct t300rs_device_entry *t300rs = data;
 	struct __packed t300rs_packet_open {
 		struct t300rs_setup_header header;
 	} *open_packet;
@@ -1287,6 +1312,43 @@ static int t300rs_send_close(struct t300rs_device_entry *t300rs)
 	return t300rs_send_int(t300rs);
 }
 
+/* raw commands from userspace, see hid-tmff2-cdev.c. Only effect commands
+ * are let through, open/close, gain, range and autocenter belong to the driver
+ * and sending them behind its back would leave it with a wrong idea of what
+ * the wheel is doing. */
+int t300rs_check_raw(void *data, const u8 *buf, size_t len)
+{
+	struct t300rs_device_entry *t300rs = data;
+	const struct t300rs_packet_header *header = (const void *)buf;
+
+	if (len < sizeof(*header) || len > t300rs->buffer_length)
+		return -EINVAL;
+
+	if (header->zero1 || !header->id)
+		return -EINVAL;
+
+	switch (header->code) {
+		case 0x89: /* play, stop */
+		case 0x64: /* new condition */
+		case 0x4c: /* modify condition */
+		case 0x6a: /* new/modify constant */
+		case 0x6b: /* new ramp, periodic */
+		case 0x6e: /* modify ramp, periodic */
+			return header->id - 1;
+		default:
+			return -EINVAL;
+	}
+}
+
+int t300rs_send_raw(void *data, const u8 *buf, size_t len)
+{
+	struct t300rs_device_entry *t300rs = data;
+
+	/* send_int leaves the rest of the buffer zeroed */
+	memcpy(t300rs->send_buffer, buf, len);
+	return t300rs_send_int(t300rs);
+}
+
 int t300rs_open(void *data, int open_mode)
 {
 	struct t300rs_device_entry *t300rs = data;
@@ -1314,36 +1376,203 @@ int t300rs_close(void *data, int open_mode)
 	return ret;
 }
 
-static int t300rs_check_firmware(struct t300rs_device_entry *t300rs)
+/* taken directly from hid_tminit */
+struct __packed t300rs_attachment_response
 {
-	int ret = 0;
-	struct t300rs_fw_response *fw_response =
-		kzalloc(sizeof(struct t300rs_fw_response), GFP_KERNEL);
+	uint16_t type;
+
+	union {
+		struct __packed {
+			uint16_t field0;
+			uint16_t field1;
+			uint8_t attachment;
+			uint8_t model;
+			uint16_t field2;
+			uint16_t field3;
+			uint16_t field4;
+			uint16_t field5;
+		} a;
+
+		struct __packed {
+			uint16_t field0;
+			uint16_t field1;
+			uint8_t attachment;
+			uint8_t model;
+		} b;
+	};
+};
 
-	if (!fw_response) {
-		hid_err(t300rs->hdev, "could not allocate fw_response\n");
-		return -ENOMEM;
+static const struct usb_ctrlrequest t300rs_attachment_request = {
+	.bRequestType = 0xc1,
+	.bRequest = 73,
+	.wValue = 0,
+	.wIndex = 0,
+	.wLength = sizeof(struct t300rs_attachment_response)
+};
+
+/*
+ * Bring-up helpers. Everything the wheels need before force feedback can be
+ * used is submitted as a batch of URBs on a single anchor and then waited on
+ * together, so a wheel that is slow to answer costs one timeout instead of
+ * one per request.
+ */
+struct t300rs_setup_batch {
+	struct usb_anchor anchor;
+	atomic_t error;
+};
+
+static void t300rs_setup_complete(struct urb *urb)
+{
+	struct t300rs_setup_batch *batch = urb->context;
+
+	/* only remember the first failure, later ones are usually fallout */
+	if (urb->status)
+		atomic_cmpxchg(&batch->error, 0, urb->status);
+}
+
+int t300rs_send_setup(struct t300rs_device_entry *t300rs,
+		const u8 *const *packets, const unsigned int *sizes, size_t count)
+{
+	struct usb_interface *usbif = to_usb_interface(t300rs->hdev->dev.parent);
+	struct usb_host_endpoint *ep = &usbif->cur_altsetting->endpoint[1];
+	struct t300rs_setup_batch batch;
+	struct urb *urb;
+	void *buf;
+	int ret = 0, i;
+
+	init_usb_anchor(&batch.anchor);
+	atomic_set(&batch.error, 0);
+
+	/* URBs queued on the same endpoint complete in submission order */
+	for (i = 0; i < count; ++i) {
+		switch (tmff2_inject_fault(t300rs->hdev)) {
+			case TMFF2_FAULT_DROP:
+				continue;
+			case TMFF2_FAULT_ERROR:
+				ret = -EIO;
+				goto err;
+			default:
+				break;
+		}
+
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		buf = kmemdup(packets[i], sizes[i], GFP_KERNEL);
+		if (!urb || !buf) {
+			usb_free_urb(urb);
+			kfree(buf);
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		usb_fill_int_urb(urb, t300rs->usbdev,
+				usb_sndintpipe(t300rs->usbdev, ep->desc.bEndpointAddress),
+				buf, sizes[i], t300rs_setup_complete, &batch,
+				ep->desc.bInterval);
+		urb->transfer_flags |= URB_FREE_BUFFER;
+
+		usb_anchor_urb(urb, &batch.anchor);
+		ret = usb_submit_urb(urb, GFP_KERNEL);
+		if (ret)
+			usb_unanchor_urb(urb);
+
+		/* the anchor holds its own reference until completion */
+		usb_free_urb(urb);
+		if (ret)
+			goto err;
 	}
 
-	/* fetch firmware version */
-	ret = usb_control_msg(t300rs->usbdev,
-			usb_rcvctrlpipe(t300rs->usbdev, 0),
-			t300rs_fw_request.bRequest,
-			t300rs_fw_request.bRequestType,
-			t300rs_fw_request.wValue,
-			t300rs_fw_request.wIndex,
-			fw_response,
-			t300rs_fw_request.wLength,
-			USB_CTRL_SET_TIMEOUT
-			);
-
-	if (ret < 0) {
-		hid_err(t300rs->hdev, "could not fetch firmware version: %i\n", ret);
+	if (!usb_wait_anchor_empty_timeout(&batch.anchor, USB_CTRL_SET_TIMEOUT)) {
+		ret = -ETIMEDOUT;
+		goto err;
+	}
+
+	if ((ret = atomic_read(&batch.error)))
 		goto out;
+
+	return 0;
+
+err:
+	usb_kill_anchored_urbs(&batch.anchor);
+out:
+	hid_err(t300rs->hdev, "setup data couldn't be sent: %i\n", ret);
+	return ret;
+}
+
+struct t300rs_query {
+	struct usb_ctrlrequest *request;
+	void *response;
+	int result;
+	ktime_t done;
+};
+
+static void t300rs_query_complete(struct urb *urb)
+{
+	struct t300rs_query *query = urb->context;
+
+	query->result = urb->status ? urb->status : urb->actual_length;
+	query->done = ktime_get();
+}
+
+static int t300rs_submit_query(struct t300rs_device_entry *t300rs,
+		struct usb_anchor *anchor, struct t300rs_query *query,
+		const struct usb_ctrlrequest *request)
+{
+	size_t len = request->wLength;
+	struct urb *urb;
+	int ret;
+
+	query->result = -EINPROGRESS;
+
+	if (tmff2_inject_fault(t300rs->hdev)) {
+		query->result = -EIO;
+		return -EIO;
+	}
+
+	/* both the setup packet and the response have to be DMA-able */
+	query->request = kmemdup(request, sizeof(*request), GFP_KERNEL);
+	query->response = kzalloc(len, GFP_KERNEL);
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!query->request || !query->response || !urb) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	query->request->wLength = cpu_to_le16(len);
+	usb_fill_control_urb(urb, t300rs->usbdev,
+			usb_rcvctrlpipe(t300rs->usbdev, 0),
+			(unsigned char *)query->request, query->response, len,
+			t300rs_query_complete, query);
+
+	usb_anchor_urb(urb, anchor);
+	if ((ret = usb_submit_urb(urb, GFP_KERNEL)))
+		usb_unanchor_urb(urb);
+
+out:
+	usb_free_urb(urb);
+	if (ret)
+		query->result = ret;
+	return ret;
+}
+
+static void t300rs_free_query(struct t300rs_query *query)
+{
+	kfree(query->request);
+	kfree(query->response);
+}
+
+static int t300rs_check_firmware(struct t300rs_device_entry *t300rs,
+		struct t300rs_query *query)
+{
+	struct t300rs_fw_response *fw_response = query->response;
+
+	if (query->result < 0) {
+		hid_err(t300rs->hdev, "could not fetch firmware version: %i\n",
+				query->result);
+		return query->result;
 	}
 
 	/* educated guess */
-	if (fw_response->fw_version < 31 && ret >= 0) {
+	if (fw_response->fw_version < 31) {
 		hid_warn(t300rs->hdev,
 				"firmware version %i might be too old, consider updating\n",
 				fw_response->fw_version
@@ -1352,85 +1581,70 @@ static int t300rs_check_firmware(struct t300rs_device_entry *t300rs)
 		hid_info(t300rs->hdev, "note: this has to be done through Windows.\n");
 	}
 
-	/* everything OK */
-	ret = 0;
-
-out:
-	kfree(fw_response);
-	return ret;
+	return 0;
 }
 
-static int t300rs_get_attachment(struct t300rs_device_entry *t300rs)
+static int t300rs_get_attachment(struct t300rs_device_entry *t300rs,
+		struct t300rs_query *query)
 {
-	/* taken directly from hid_tminit */
-	struct __packed t300rs_attachment_response
-	{
-		uint16_t type;
-
-		union {
-			struct __packed {
-				uint16_t field0;
-				uint16_t field1;
-				uint8_t attachment;
-				uint8_t model;
-				uint16_t field2;
-				uint16_t field3;
-				uint16_t field4;
-				uint16_t field5;
-			} a;
-
-			struct __packed {
-				uint16_t field0;
-				uint16_t field1;
-				uint8_t attachment;
-				uint8_t model;
-			} b;
-		};
-	} *response = kzalloc(GFP_KERNEL, sizeof(struct t300rs_attachment_response));
-	struct usb_ctrlrequest t300rs_attachment_rq = {
-		.bRequestType = 0xc1,
-		.bRequest = 73,
-		.wValue = 0,
-		.wIndex = 0,
-		.wLength = sizeof(struct t300rs_attachment_response)
-	};
-	int ret, attachment;
-	if (!response)
-		return -ENODEV;
+	struct t300rs_attachment_response *response = query->response;
 
-	ret = usb_control_msg(t300rs->usbdev,
-			usb_rcvctrlpipe(t300rs->usbdev, 0),
-			t300rs_attachment_rq.bRequest,
-			t300rs_attachment_rq.bRequestType,
-			t300rs_attachment_rq.wValue,
-			t300rs_attachment_rq.wIndex,
-			response,
-			sizeof(struct t300rs_attachment_response),
-			USB_CTRL_SET_TIMEOUT
-			);
-
-	if (ret < 0) {
-		hid_err(t300rs->hdev, "could not fetch attachment: %i\n", ret);
-		goto out;
+	if (query->result < 0) {
+		hid_err(t300rs->hdev, "could not fetch attachment: %i\n", query->result);
+		return query->result;
 	}
 
-	if (response->type == cpu_to_le16(0x49)) {
-		attachment = response->a.attachment;
-	} else if (response->type == cpu_to_le16(0x47)) {
-		attachment = response->b.attachment;
-	} else {
-		hid_err(t300rs->hdev,
-				"unknown packet type %hx\n, please contact a maintainer",
-				response->type);
-		ret = -EINVAL;
-		goto out;
+	if (response->type == cpu_to_le16(0x49))
+		return response->a.attachment;
+
+	if (response->type == cpu_to_le16(0x47))
+		return response->b.attachment;
+
+	hid_err(t300rs->hdev,
+			"unknown packet type %hx\n, please contact a maintainer",
+			response->type);
+	return -EINVAL;
+}
+
+/*
+ * Query firmware version and attachment in one go. The two control
+ * transfers are queued back to back and waited on together, a wheel that
+ * ignores them then only stalls probe for a single timeout.
+ */
+static int t300rs_query_wheel(struct tmff2_device_entry *tmff2,
+		struct t300rs_device_entry *t300rs)
+{
+	struct t300rs_query fw = {0}, attachment = {0};
+	struct usb_anchor anchor;
+	ktime_t start;
+	int ret;
+
+	init_usb_anchor(&anchor);
+	start = ktime_get();
+
+	t300rs_submit_query(t300rs, &anchor, &fw, &t300rs_fw_request);
+	t300rs_submit_query(t300rs, &anchor, &attachment,
+			&t300rs_attachment_request);
+
+	if (!usb_wait_anchor_empty_timeout(&anchor, USB_CTRL_GET_TIMEOUT)) {
+		hid_warn(t300rs->hdev, "timed out querying wheel\n");
+		usb_kill_anchored_urbs(&anchor);
 	}
 
-	kfree(response);
-	return attachment;
+	/* the queries run concurrently, time each up to its own completion */
+	if (fw.done)
+		tmff2_boot_mark(tmff2, TMFF2_BOOT_FIRMWARE, start, fw.done);
 
-out:
-	kfree(response);
+	if (attachment.done)
+		tmff2_boot_mark(tmff2, TMFF2_BOOT_ATTACHMENT, start, attachment.done);
+
+	ret = t300rs_check_firmware(t300rs, &fw);
+
+	if ((t300rs->attachment = t300rs_get_attachment(t300rs, &attachment)) < 0)
+		t300rs->attachment = T300RS_DEFAULT_ATTACHMENT;
+
+	t300rs_free_query(&fw);
+	t300rs_free_query(&attachment);
 	return ret;
 }
 
@@ -1448,6 +1662,7 @@ static int t300rs_wheel_init(struct tmff2_device_entry *tmff2, int open_mode)
 	t300rs->hdev = tmff2->hdev;
 	t300rs->input_dev = tmff2->input_dev;
 	t300rs->usbdev = to_usb_device(tmff2->hdev->dev.parent->parent);
+	t300rs->settings = &tmff2->settings;
 
 	if(t300rs->hdev->product == TMT300RS_PS4_NORM_ID)
 		t300rs->buffer_length = T300RS_PS4_BUFFER_LENGTH;
@@ -1460,7 +1675,7 @@ static int t300rs_wheel_init(struct tmff2_device_entry *tmff2, int open_mode)
 		goto send_err;
 	}
 
-	if ((ret = t300rs_check_firmware(t300rs)))
+	if ((ret = t300rs_query_wheel(tmff2, t300rs)))
 		goto firmware_err;
 
 	report_list = &t300rs->hdev->report_enum[HID_OUTPUT_REPORT].report_list;
@@ -1473,9 +1688,8 @@ static int t300rs_wheel_init(struct tmff2_device_entry *tmff2, int open_mode)
 	t300rs->close = t300rs->input_dev->close;
 
 	/* TODO: PS4 advanced mode? */
-	alt_mode = (t300rs->mode = (t300rs->hdev->product == TMT300RS_PS3_ADV_ID));
-	if ((t300rs->attachment = t300rs_get_attachment(t300rs)) < 0)
-		t300rs->attachment = T300RS_DEFAULT_ATTACHMENT;
+	tmff2->settings.alt_mode =
+		(t300rs->mode = (t300rs->hdev->product == TMT300RS_PS3_ADV_ID));
 
 	/* everythin went OK */
 	tmff2->data = t300rs;
@@ -1537,19 +1751,24 @@ static __u8 *t300rs_wheel_fixup(struct hid_device *hdev, __u8 *rdesc,
 
 int t300rs_populate_api(struct tmff2_device_entry *tmff2)
 {
-	/* set callbacks */
-	tmff2->play_effect = t300rs_play_effect;
-	tmff2->upload_effect = t300rs_upload_effect;
-	tmff2->update_effect = t300rs_update_effect;
-	tmff2->stop_effect = t300rs_stop_effect;
+	/* effect commands are dispatched directly for the T300RS family */
+	tmff2->family = TMFF2_FAMILY_T300RS;
 
+	/* set callbacks */
 	tmff2->wheel_init = t300rs_wheel_init;
 	tmff2->wheel_destroy = t300rs_wheel_destroy;
 
 	tmff2->open = t300rs_open;
 	tmff2->close = t300rs_close;
+	tmff2->send_open = t300rs_send_open;
+	tmff2->send_close = t300rs_send_close;
+	tmff2->check_raw = t300rs_check_raw;
+	tmff2->send_level = t300rs_send_level;
+	tmff2->send_raw = t300rs_send_raw;
 	tmff2->set_gain = t300rs_set_gain;
 	tmff2->set_range = t300rs_set_range;
+	tmff2->range_min = 40;
+	tmff2->range_max = 1080;
 	tmff2->switch_mode = t300rs_switch_mode;
 	tmff2->alt_mode_show = t300rs_alt_mode_show;
 	tmff2->alt_mode_store = t300rs_alt_mode_store;
@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Replay a session recorded through debugfs tmff2/<device>/trace against an
+ * evdev node, at the original pace or scaled by -s.
+ *
+ *	tmff2-replay [-s speed] /dev/input/eventX session.bin
+ *
+ * Speed 0 sends everything back to back. Effect ids are assigned by ff-core
+ * again on replay, recorded ids are mapped to whatever the kernel hands out.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "hid-tmff2-uapi.h"
+
+#define MAX_IDS 256
+
+struct stats {
+	unsigned long records;
+	unsigned long failed;
+	unsigned long long late_total;
+	unsigned long long late_max;
+};
+
+static int ids[MAX_IDS];
+
+static int read_full(FILE *f, void *buf, size_t len)
+{
+	return fread(buf, len, 1, f) == 1 ? 0 : -1;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long long ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+			== EINTR)
+		;
+}
+
+static void to_effect(const struct tmff2_trace_effect *e,
+		struct ff_effect *effect)
+{
+	memset(effect, 0, sizeof(*effect));
+	effect->type = e->type;
+	effect->direction = e->direction;
+	effect->trigger.button = e->trigger_button;
+	effect->trigger.interval = e->trigger_interval;
+	effect->replay.length = e->replay_length;
+	effect->replay.delay = e->replay_delay;
+
+	switch (e->type) {
+	case FF_CONSTANT:
+		effect->u.constant = e->u.constant;
+		break;
+	case FF_RAMP:
+		effect->u.ramp = e->u.ramp;
+		break;
+	case FF_PERIODIC:
+		effect->u.periodic.waveform = e->u.periodic.waveform;
+		effect->u.periodic.period = e->u.periodic.period;
+		effect->u.periodic.magnitude = e->u.periodic.magnitude;
+		effect->u.periodic.offset = e->u.periodic.offset;
+		effect->u.periodic.phase = e->u.periodic.phase;
+		effect->u.periodic.envelope = e->u.periodic.envelope;
+		break;
+	case FF_SPRING:
+	case FF_DAMPER:
+	case FF_FRICTION:
+	case FF_INERTIA:
+		effect->u.condition[0] = e->u.condition[0];
+		effect->u.condition[1] = e->u.condition[1];
+		break;
+	case FF_RUMBLE:
+		effect->u.rumble = e->u.rumble;
+		break;
+	}
+}
+
+static int send_event(int fd, int code, int value)
+{
+	struct input_event ev = {
+		.type = EV_FF,
+		.code = code,
+		.value = value,
+	};
+
+	return write(fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -1;
+}
+
+static int upload(int fd, const struct tmff2_trace_record *record,
+		const struct tmff2_trace_effect *e)
+{
+	struct ff_effect effect;
+	int *id = &ids[record->id];
+
+	/* erases aren't recorded, a fresh upload to a known id means the
+	 * original was erased at some point */
+	if (!record->update && *id >= 0) {
+		ioctl(fd, EVIOCRMFF, *id);
+		*id = -1;
+	}
+
+	to_effect(e, &effect);
+	effect.id = *id;
+	if (ioctl(fd, EVIOCSFF, &effect) < 0)
+		return -1;
+
+	*id = effect.id;
+	return 0;
+}
+
+static int replay(int fd, FILE *f, double speed, struct stats *stats)
+{
+	struct tmff2_trace_record record;
+	struct tmff2_trace_effect e;
+	unsigned long long start, target, now;
+	int ret;
+
+	start = now_ns();
+	while (!read_full(f, &record, sizeof(record))) {
+		if (record.type == TMFF2_TRACE_UPLOAD &&
+				read_full(f, &e, sizeof(e))) {
+			fprintf(stderr, "truncated upload record\n");
+			return -1;
+		}
+
+		if (speed > 0) {
+			target = start + record.time_ns / speed;
+			sleep_until(target);
+			now = now_ns();
+			if (now > target) {
+				stats->late_total += now - target;
+				if (now - target > stats->late_max)
+					stats->late_max = now - target;
+			}
+		}
+
+		if (record.id >= MAX_IDS) {
+			stats->failed++;
+			continue;
+		}
+
+		switch (record.type) {
+		case TMFF2_TRACE_UPLOAD:
+			ret = record.id < 0 ? -1 : upload(fd, &record, &e);
+			break;
+		case TMFF2_TRACE_PLAY:
+			ret = record.id < 0 || ids[record.id] < 0 ? -1 :
+				send_event(fd, ids[record.id], record.value);
+			break;
+		case TMFF2_TRACE_GAIN:
+			ret = send_event(fd, FF_GAIN, record.value);
+			break;
+		case TMFF2_TRACE_AUTOCENTER:
+			ret = send_event(fd, FF_AUTOCENTER, record.value);
+			break;
+		default:
+			fprintf(stderr, "unknown record type %u\n", record.type);
+			return -1;
+		}
+
+		stats->records++;
+		if (ret)
+			stats->failed++;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s speed] /dev/input/eventX session.bin\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tmff2_trace_header header;
+	struct stats stats = {0};
+	double speed = 1.0;
+	FILE *f;
+	int fd, opt, i, ret;
+
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if ((fd = open(argv[optind], O_RDWR)) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (!(f = fopen(argv[optind + 1], "rb"))) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	if (read_full(f, &header, sizeof(header)) ||
+			header.magic != TMFF2_TRACE_MAGIC ||
+			header.version != TMFF2_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a tmff2 trace\n", argv[optind + 1]);
+		return 1;
+	}
+
+	printf("replaying session from %04x:%04x, %u effect slots\n",
+			header.vendor, header.product, header.max_effects);
+
+	for (i = 0; i < MAX_IDS; ++i)
+		ids[i] = -1;
+
+	ret = replay(fd, f, speed, &stats);
+
+	for (i = 0; i < MAX_IDS; ++i)
+		if (ids[i] >= 0)
+			ioctl(fd, EVIOCRMFF, ids[i]);
+
+	printf("records: %lu, failed: %lu\n", stats.records, stats.failed);
+	if (speed > 0 && stats.records)
+		printf("lateness avg/max: %llu/%llu us\n",
+				stats.late_total / stats.records / 1000,
+				stats.late_max / 1000);
+
+	fclose(f);
+	close(fd);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,595 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Discrete-event simulator of the tmff2 effect scheduler. The slot state
+ * machine is the driver's own, from src/hid-tmff2-sched.h, the rest of the
+ * work handler, the delayed work timer and the wheel are modelled here on a
+ * simulated clock, so scheduling policies can be compared over many sessions
+ * without a wheel.
+ *
+ *	tmff2-sim [options]
+ *	  -t ms      work handler period (timer_msecs), default 8
+ *	  -u ms      delay before an upload is picked up, default the period
+ *	  -z hz      kernel HZ, default 250
+ *	  -W         wait for the wheel once per tick instead of after each slot
+ *	  -P         handle starts and stops before updates within a tick
+ *	  -q n       packets the wheel can have queued before dropping, default 16
+ *	  -l us      time the wheel takes per packet, default 1000
+ *	  -e n       effect slots, default 16
+ *	  -r hz      how often the game updates its constant force, default 120
+ *	  -d s       length of a session, default 60
+ *	  -n n       number of sessions, default 100
+ *	  -s seed    random seed, default 1
+ *	  -f file    replay a recorded trace instead of generating sessions
+ *
+ * The work handler runs atomically on the simulated clock, so ff-core calls
+ * that would arrive while it is waiting on the wheel are applied once it
+ * returns. Gain and autocenter commands aren't modelled.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tmff2-shim.h"
+#include "hid-tmff2-sched.h"
+#include "hid-tmff2-uapi.h"
+
+#define NONE		UINT64_MAX
+#define USEC		1000000ULL
+
+/* latency histogram, 10 us buckets up to 100 ms */
+#define HIST_STEP	10
+#define HIST_BUCKETS	10000
+
+enum sim_event_type {
+	SIM_UPLOAD,
+	SIM_PLAY,
+};
+
+struct sim_event {
+	uint64_t time;	/* us */
+	unsigned int seq;
+	unsigned char type;
+	unsigned char update;
+	short slot;
+	int value;
+	unsigned short delay;
+	unsigned short length;
+};
+
+struct sim_config {
+	unsigned int tick_ms;
+	int upload_ms;
+	unsigned int hz;
+	bool wait_per_tick;
+	bool priority;
+	unsigned int depth;
+	unsigned int service_us;
+	unsigned int effects;
+	unsigned int update_hz;
+	unsigned int duration_s;
+	unsigned int sessions;
+	uint64_t seed;
+	const char *trace;
+};
+
+struct sim_slot {
+	unsigned long flags;
+	struct tmff2_effect_timing timing;
+	uint64_t requested;	/* oldest request not served yet */
+	unsigned int merged;	/* requests since then */
+	bool done;
+};
+
+struct sim_stats {
+	uint64_t simulated;
+	unsigned long long ticks;
+	unsigned long long idle_ticks;
+	unsigned long long requests;
+	unsigned long long coalesced;
+	unsigned long long packets;
+	unsigned long long dropped;
+	unsigned long long served;
+	unsigned long long latency_total;
+	uint64_t latency_max;
+	unsigned long long hist[HIST_BUCKETS + 1];
+};
+
+struct sim {
+	const struct sim_config *config;
+	struct sim_slot *slots;
+	struct sim_stats *stats;
+	uint64_t now;
+	uint64_t work_at;
+	uint64_t busy_until;
+};
+
+struct sim_events {
+	struct sim_event *ev;
+	size_t len;
+	size_t size;
+};
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned int rng_range(unsigned int low, unsigned int high)
+{
+	return low + rng() % (high - low + 1);
+}
+
+static uint64_t jiffies_at(const struct sim *sim, uint64_t t)
+{
+	return t * sim->config->hz / USEC;
+}
+
+static uint32_t msecs_at(const struct sim *sim, uint64_t t)
+{
+	/* JIFFIES2MS */
+	return jiffies_at(sim, t) * 1000 / sim->config->hz;
+}
+
+/* when schedule_delayed_work() with a delay of ms would run the handler */
+static uint64_t sim_timer(const struct sim *sim, uint64_t t, unsigned int ms)
+{
+	unsigned int hz = sim->config->hz;
+	uint64_t j;
+
+	if (!ms)
+		return t;
+
+	j = jiffies_at(sim, t) + (ms * hz + 999) / 1000;
+	return (j * USEC + hz - 1) / hz;
+}
+
+static void sim_kick(struct sim *sim, unsigned int ms)
+{
+	if (sim->work_at == NONE)
+		sim->work_at = sim_timer(sim, sim->now, ms);
+}
+
+/* hand a packet to the wheel at time t, returns when it is done with it or
+ * NONE if its queue was full */
+static uint64_t sim_send(struct sim *sim, uint64_t t)
+{
+	const struct sim_config *config = sim->config;
+	uint64_t start = sim->busy_until > t ? sim->busy_until : t;
+
+	if ((start - t) / config->service_us >= config->depth) {
+		sim->stats->dropped++;
+		return NONE;
+	}
+
+	sim->stats->packets++;
+	sim->busy_until = start + config->service_us;
+	return sim->busy_until;
+}
+
+static void sim_account(struct sim *sim, struct sim_slot *slot, uint64_t done)
+{
+	struct sim_stats *stats = sim->stats;
+	uint64_t requested = slot->requested;
+	uint64_t latency;
+
+	if (requested == NONE)
+		return;
+
+	stats->coalesced += slot->merged - 1;
+	slot->requested = NONE;
+	slot->merged = 0;
+
+	if (done == NONE)
+		return;
+
+	latency = done - requested;
+	stats->served++;
+	stats->latency_total += latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+
+	stats->hist[latency / HIST_STEP < HIST_BUCKETS ?
+		latency / HIST_STEP : HIST_BUCKETS]++;
+}
+
+static void sim_request(struct sim *sim, struct sim_slot *slot)
+{
+	sim->stats->requests++;
+	if (slot->requested == NONE)
+		slot->requested = sim->now;
+	slot->merged++;
+}
+
+static void sim_apply(struct sim *sim, const struct sim_event *ev)
+{
+	const struct sim_config *config = sim->config;
+	struct sim_slot *slot;
+
+	if (ev->slot < 0 || (unsigned int)ev->slot >= config->effects)
+		return;
+
+	slot = &sim->slots[ev->slot];
+	sim_request(sim, slot);
+
+	switch (ev->type) {
+	case SIM_UPLOAD:
+		slot->timing.delay = ev->delay;
+		slot->timing.length = ev->length;
+		tmff2_sched_request_upload(&slot->flags, ev->update);
+		sim_kick(sim, config->upload_ms < 0 ?
+				config->tick_ms : (unsigned int)config->upload_ms);
+		break;
+	case SIM_PLAY:
+		if (ev->value > 0) {
+			slot->timing.count = ev->value;
+			slot->timing.start_time = msecs_at(sim, sim->now);
+		}
+		tmff2_sched_request_play(&slot->flags, ev->value);
+		sim_kick(sim, 0);
+		break;
+	}
+}
+
+/* one slot of tmff2_work_handler, every action is one packet */
+static bool sim_slot(struct sim *sim, struct sim_slot *slot, uint64_t *t,
+		uint32_t time_now, int *sent)
+{
+	unsigned long actions;
+	uint64_t done = NONE;
+	bool playing;
+	int bit;
+
+	slot->done = true;
+	actions = tmff2_sched_take(&slot->flags);
+	playing = tmff2_sched_advance(&slot->flags, &actions, &slot->timing,
+			time_now);
+
+	if (!actions) {
+		/* requests dropped as the effect ran out */
+		sim_account(sim, slot, NONE);
+		return playing;
+	}
+
+	for (bit = FF_EFFECT_QUEUE_UPLOAD; bit <= FF_EFFECT_QUEUE_UPDATE; ++bit) {
+		if (!test_bit(bit, &actions))
+			continue;
+
+		done = sim_send(sim, *t);
+		++*sent;
+	}
+
+	sim_account(sim, slot, done);
+
+	if (!sim->config->wait_per_tick && sim->busy_until > *t)
+		*t = sim->busy_until;
+
+	return playing;
+}
+
+static void sim_work(struct sim *sim)
+{
+	const struct sim_config *config = sim->config;
+	uint64_t t = sim->now;
+	uint32_t time_now = msecs_at(sim, t);
+	unsigned int i;
+	int reschedule = 0, sent = 0;
+
+	sim->stats->ticks++;
+
+	for (i = 0; i < config->effects; ++i)
+		sim->slots[i].done = false;
+
+	if (config->priority) {
+		for (i = 0; i < config->effects; ++i) {
+			unsigned long flags = sim->slots[i].flags;
+
+			if (test_bit(FF_EFFECT_QUEUE_START, &flags) ||
+					test_bit(FF_EFFECT_QUEUE_STOP, &flags))
+				reschedule |= sim_slot(sim, &sim->slots[i],
+						&t, time_now, &sent);
+		}
+	}
+
+	for (i = 0; i < config->effects; ++i)
+		if (!sim->slots[i].done)
+			reschedule |= sim_slot(sim, &sim->slots[i], &t,
+					time_now, &sent);
+
+	if (config->wait_per_tick && sim->busy_until > t)
+		t = sim->busy_until;
+
+	if (!sent)
+		sim->stats->idle_ticks++;
+
+	sim->now = t;
+	if (reschedule)
+		sim_kick(sim, config->tick_ms);
+}
+
+static void sim_run(const struct sim_config *config, struct sim_stats *stats,
+		const struct sim_events *events, uint64_t end)
+{
+	struct sim sim = {
+		.config = config,
+		.stats = stats,
+		.now = 0,
+		.work_at = NONE,
+		.busy_until = 0,
+	};
+	size_t next = 0;
+	unsigned int i;
+
+	sim.slots = calloc(config->effects, sizeof(*sim.slots));
+	for (i = 0; i < config->effects; ++i)
+		sim.slots[i].requested = NONE;
+
+	while (next < events->len || sim.work_at != NONE) {
+		if (next < events->len && events->ev[next].time <= sim.work_at) {
+			if (events->ev[next].time > sim.now)
+				sim.now = events->ev[next].time;
+			sim_apply(&sim, &events->ev[next++]);
+			continue;
+		}
+
+		/* infinite effects keep the handler ticking forever */
+		if (sim.work_at > end)
+			break;
+
+		if (sim.work_at > sim.now)
+			sim.now = sim.work_at;
+		sim.work_at = NONE;
+		sim_work(&sim);
+	}
+
+	stats->simulated += end;
+	free(sim.slots);
+}
+
+static struct sim_event *sim_add(struct sim_events *events, uint64_t time,
+		int type, int slot)
+{
+	struct sim_event *ev;
+
+	if (events->len == events->size) {
+		events->size = events->size ? events->size * 2 : 1024;
+		events->ev = realloc(events->ev,
+				events->size * sizeof(*events->ev));
+		if (!events->ev) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	ev = &events->ev[events->len];
+	memset(ev, 0, sizeof(*ev));
+	ev->time = time;
+	ev->seq = events->len++;
+	ev->type = type;
+	ev->slot = slot;
+	return ev;
+}
+
+static int sim_event_cmp(const void *a, const void *b)
+{
+	const struct sim_event *x = a, *y = b;
+
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* a game-like session: a constant force updated every frame with some jitter,
+ * spring and damper running throughout, and short rumble effects on top */
+static void sim_generate(const struct sim_config *config,
+		struct sim_events *events)
+{
+	uint64_t end = config->duration_s * USEC;
+	uint64_t frame = USEC / config->update_hz;
+	uint64_t t;
+	struct sim_event *ev;
+	unsigned int slot, i;
+
+	events->len = 0;
+
+	for (i = 0; i < 3 && i < config->effects; ++i) {
+		sim_add(events, 0, SIM_UPLOAD, i);
+		sim_add(events, 0, SIM_PLAY, i)->value = 1;
+	}
+
+	for (t = frame; t < end; t += rng_range(frame * 8 / 10, frame * 12 / 10))
+		sim_add(events, t, SIM_UPLOAD, 0)->update = 1;
+
+	if (config->effects > 3) {
+		for (t = rng_range(0, 2 * USEC); t < end;
+				t += rng_range(USEC / 10, 2 * USEC)) {
+			slot = rng_range(3, config->effects - 1);
+			ev = sim_add(events, t, SIM_UPLOAD, slot);
+			ev->length = rng_range(100, 500);
+			sim_add(events, t, SIM_PLAY, slot)->value = 1;
+
+			/* some get cut short */
+			if (rng() % 4 == 0)
+				sim_add(events, t + rng_range(20, 100) * 1000,
+						SIM_PLAY, slot);
+		}
+	}
+
+	for (i = 0; i < 3 && i < config->effects; ++i)
+		sim_add(events, end, SIM_PLAY, i);
+
+	qsort(events->ev, events->len, sizeof(*events->ev), sim_event_cmp);
+}
+
+static int sim_load(const char *path, struct sim_events *events,
+		uint64_t *end)
+{
+	struct tmff2_trace_header header;
+	struct tmff2_trace_record record;
+	struct tmff2_trace_effect e;
+	struct sim_event *ev;
+	FILE *f;
+
+	if (!(f = fopen(path, "rb"))) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+			header.magic != TMFF2_TRACE_MAGIC ||
+			header.version != TMFF2_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a tmff2 trace\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	*end = 0;
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		if (record.type == TMFF2_TRACE_UPLOAD &&
+				fread(&e, sizeof(e), 1, f) != 1)
+			break;
+
+		*end = record.time_ns / 1000;
+		if (record.type == TMFF2_TRACE_UPLOAD) {
+			ev = sim_add(events, *end, SIM_UPLOAD, record.id);
+			ev->update = record.update;
+			ev->delay = e.replay_delay;
+			ev->length = e.replay_length;
+		} else if (record.type == TMFF2_TRACE_PLAY) {
+			ev = sim_add(events, *end, SIM_PLAY, record.id);
+			ev->value = record.value;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static uint64_t sim_percentile(const struct sim_stats *stats, unsigned int pct)
+{
+	unsigned long long want = (stats->served * pct + 99) / 100, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i <= HIST_BUCKETS; ++i) {
+		seen += stats->hist[i];
+		if (seen >= want)
+			return i < HIST_BUCKETS ?
+				(uint64_t)(i + 1) * HIST_STEP : stats->latency_max;
+	}
+
+	return stats->latency_max;
+}
+
+static void sim_report(const struct sim_stats *stats, double wall)
+{
+	printf("simulated: %.1f s in %.2f s\n", stats->simulated / 1e6, wall);
+	printf("ticks: %llu, idle: %llu\n", stats->ticks, stats->idle_ticks);
+	printf("requests: %llu, coalesced: %llu\n", stats->requests,
+			stats->coalesced);
+	printf("packets: %llu, dropped: %llu\n", stats->packets,
+			stats->dropped);
+
+	if (!stats->served)
+		return;
+
+	printf("latency avg/p50/p99/max: %llu/%llu/%llu/%llu us\n",
+			stats->latency_total / stats->served,
+			(unsigned long long)sim_percentile(stats, 50),
+			(unsigned long long)sim_percentile(stats, 99),
+			(unsigned long long)stats->latency_max);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t ms] [-u ms] [-z hz] [-W] [-P] [-q n] "
+			"[-l us] [-e n] [-r hz] [-d s] [-n n] [-s seed] "
+			"[-f trace]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_config config = {
+		.tick_ms = 8,
+		.upload_ms = -1,
+		.hz = 250,
+		.depth = 16,
+		.service_us = 1000,
+		.effects = 16,
+		.update_hz = 120,
+		.duration_s = 60,
+		.sessions = 100,
+		.seed = 1,
+	};
+	struct sim_events events = {0};
+	struct sim_stats *stats;
+	struct timespec start, stop;
+	uint64_t end;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:u:z:WPq:l:e:r:d:n:s:f:h")) != -1) {
+		switch (opt) {
+		case 't': config.tick_ms = atoi(optarg); break;
+		case 'u': config.upload_ms = atoi(optarg); break;
+		case 'z': config.hz = atoi(optarg); break;
+		case 'W': config.wait_per_tick = true; break;
+		case 'P': config.priority = true; break;
+		case 'q': config.depth = atoi(optarg); break;
+		case 'l': config.service_us = atoi(optarg); break;
+		case 'e': config.effects = atoi(optarg); break;
+		case 'r': config.update_hz = atoi(optarg); break;
+		case 'd': config.duration_s = atoi(optarg); break;
+		case 'n': config.sessions = atoi(optarg); break;
+		case 's': config.seed = strtoull(optarg, NULL, 0); break;
+		case 'f': config.trace = optarg; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!config.tick_ms || !config.hz || !config.depth ||
+			!config.service_us || !config.effects ||
+			!config.update_hz || !config.duration_s) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!(stats = calloc(1, sizeof(*stats)))) {
+		perror("calloc");
+		return 1;
+	}
+
+	rng_state = config.seed ? config.seed : 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (config.trace) {
+		if (sim_load(config.trace, &events, &end))
+			return 1;
+
+		qsort(events.ev, events.len, sizeof(*events.ev), sim_event_cmp);
+		sim_run(&config, stats, &events, end + USEC);
+	} else {
+		for (i = 0; i < config.sessions; ++i) {
+			sim_generate(&config, &events);
+			sim_run(&config, stats, &events,
+					config.duration_s * USEC);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	sim_report(stats, (stop.tv_sec - start.tv_sec) +
+			(stop.tv_nsec - start.tv_nsec) / 1e9);
+
+	free(events.ev);
+	free(stats);
+	return 0;
+}